@@ -14,12 +14,18 @@ add_files "main.cpp"
 add_files "oclErrorCodes.cpp"
 add_files "oclHelper.cpp"
 add_files "pgm.cpp"
+add_files "fastCpu.cpp"
+add_files "threadPool.cpp"
 
 # Header files
 add_files "oclHelper.h"
 set_property file_type "c header files" [get_files "oclHelper.h"]
 add_files "pgm.h"
 set_property file_type "c header files" [get_files "pgm.h"]
+add_files "fastCpu.h"
+set_property file_type "c header files" [get_files "fastCpu.h"]
+add_files "threadPool.h"
+set_property file_type "c header files" [get_files "threadPool.h"]
 
 # Kernel definition
 create_kernel locate_features -type clc
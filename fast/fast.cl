@@ -15,6 +15,12 @@
 #define ARC_LENGTH 9
 #define NONMAX 1
 
+// Grayscale pixels are 8-bit, build with -DPIXEL_TYPE=int for hosts that
+// still upload 32-bit pixels
+#ifndef PIXEL_TYPE
+#define PIXEL_TYPE uchar
+#endif
+
 #define MAX_VAL(A,B) (A<B) ? (B) : (A)
 
 inline int idx_y(const int i)
@@ -52,42 +58,38 @@ inline int test_smaller(const int x, const int p, const int thr)
 // Returns -1 when x < p - thr
 // Returns  0 when x >= p - thr && x <= p + thr
 // Returns  1 when x > p + thr
-inline int test_pixel(__local int* local_image, const int p, const int thr, const int x, const int y)
+inline int test_pixel(__local PIXEL_TYPE* local_image, const int p, const int thr, const int x, const int y)
 {
     return -test_smaller(local_image[idx(x,y)], p, thr) | test_greater(local_image[idx(x,y)], p, thr);
 }
 
-void locate_features_core(
-    __local int* local_image,
-    __global int* score,
-    const int d0,
-    const int d1,
-    const int thr,
-    int x, int y,
-    const unsigned edge)
+// locate_features_core()
+// Score of the pixel at the centre of the local patch, 0 when it is not a
+// feature
+int locate_features_core(
+    __local PIXEL_TYPE* local_image,
+    const int thr)
 {
-    if (x >= d0 - edge || y >= d1 - edge) return;
-
     int p = local_image[idx(0, 0)];
 
     // Start by testing opposite pixels of the circle that will result in
     // a non-kepoint
     int d = test_pixel(local_image, p, thr, -3,  0) | test_pixel(local_image, p, thr, 3,  0);
     if (d == 0)
-        return;
+        return 0;
 
     d &= test_pixel(local_image, p, thr, -2,  2) | test_pixel(local_image, p, thr,  2, -2);
     d &= test_pixel(local_image, p, thr,  0,  3) | test_pixel(local_image, p, thr,  0, -3);
     d &= test_pixel(local_image, p, thr,  2,  2) | test_pixel(local_image, p, thr, -2, -2);
     if (d == 0)
-        return;
+        return 0;
 
     d &= test_pixel(local_image, p, thr, -3,  1) | test_pixel(local_image, p, thr,  3, -1);
     d &= test_pixel(local_image, p, thr, -1,  3) | test_pixel(local_image, p, thr,  1, -3);
     d &= test_pixel(local_image, p, thr,  1,  3) | test_pixel(local_image, p, thr, -1, -3);
     d &= test_pixel(local_image, p, thr,  3,  1) | test_pixel(local_image, p, thr, -3, -1);
     if (d == 0)
-        return;
+        return 0;
 
     int sum = 0;
 
@@ -131,15 +133,16 @@ void locate_features_core(
             s_dark   += test_smaller(p_x, p, thr) * weight;
         }
 
-        score[x + d0 * y] = MAX_VAL(s_bright, s_dark);
+        return MAX_VAL(s_bright, s_dark);
     }
+    return 0;
 }
 
 void load_shared_image(
-    __global const int *in,
+    __global const PIXEL_TYPE *in,
     const int d0,
     const int d1,
-    __local int *local_image,
+    __local PIXEL_TYPE *local_image,
     unsigned ix, unsigned iy,
     unsigned bx, unsigned by,
     unsigned  x, unsigned  y,
@@ -159,13 +162,80 @@ void load_shared_image(
 
 __kernel __attribute__ ((reqd_work_group_size(FAST_THREADS_X, FAST_THREADS_Y, 1)))
 void locate_features(
-    __global const int *in,
+    __global const PIXEL_TYPE *in,
     const int d0,
     const int d1,
     __global int* score,
     const int thr,
     const unsigned edge,
-    __local int* local_image)
+    __local PIXEL_TYPE* local_image)
+{
+    unsigned ix = get_local_id(0);
+    unsigned iy = get_local_id(1);
+    unsigned bx = get_local_size(0);
+    unsigned by = get_local_size(1);
+    unsigned x = bx * get_group_id(0) + ix + edge;
+    unsigned y = by * get_group_id(1) + iy + edge;
+    unsigned lx = bx / 2 + 3;
+    unsigned ly = by / 2 + 3;
+
+    load_shared_image(in, d0, d1, local_image, ix, iy, bx, by, x, y, lx, ly);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Every tested pixel is written, zero or not, so the score map needs no
+    // clearing between frames
+    if (x < d0 - edge && y < d1 - edge)
+        score[x + d0 * y] = locate_features_core(local_image, thr);
+}
+
+// strength_core()
+// Highest threshold at which the pixel still passes the segment test: the
+// largest, over all arcs of ARC_LENGTH pixels, of the smallest difference
+// to p along the arc, taken for brighter and darker arcs. A pixel passes
+// with thr > 0 exactly when its strength is >= thr, 0 when it never does.
+void strength_core(
+    __local PIXEL_TYPE* local_image,
+    __global int* strength,
+    const int d0,
+    const int d1,
+    int x, int y,
+    const unsigned edge)
+{
+    if (x >= d0 - edge || y >= d1 - edge) return;
+
+    int p = local_image[idx(0, 0)];
+
+    int diff[16];
+    for (int i = 0; i < 16; i++)
+        diff[i] = (int)local_image[idx(idx_x(i), idx_y(i))] - p;
+
+    int s_bright = 0, s_dark = 0;
+    for (int i = 0; i < 16; i++) {
+        int min_bright = diff[i], min_dark = -diff[i];
+        for (int j = 1; j < ARC_LENGTH; j++) {
+            min_bright = min(min_bright,  diff[(i + j) & 15]);
+            min_dark   = min(min_dark,   -diff[(i + j) & 15]);
+        }
+        s_bright = max(s_bright, min_bright);
+        s_dark   = max(s_dark,   min_dark);
+    }
+
+    strength[x + d0 * y] = MAX_VAL(s_bright, s_dark);
+}
+
+// strength_map()
+// Threshold independent version of locate_features(): writes the strength
+// of every tested pixel, so features for any threshold can be found by
+// filtering the map instead of running the segment test again. Scores and
+// the non-maximal suppression still depend on the threshold.
+__kernel __attribute__ ((reqd_work_group_size(FAST_THREADS_X, FAST_THREADS_Y, 1)))
+void strength_map(
+    __global const PIXEL_TYPE *in,
+    const int d0,
+    const int d1,
+    __global int* strength,
+    const unsigned edge,
+    __local PIXEL_TYPE* local_image)
 {
     unsigned ix = get_local_id(0);
     unsigned iy = get_local_id(1);
@@ -178,135 +248,153 @@ void locate_features(
 
     load_shared_image(in, d0, d1, local_image, ix, iy, bx, by, x, y, lx, ly);
     barrier(CLK_LOCAL_MEM_FENCE);
-    locate_features_core(local_image, score, d0, d1, thr, x, y, edge);
+    strength_core(local_image, strength, d0, d1, x, y, edge);
 }
 
-//__kernel
-//void non_max_counts(
-//    __global unsigned *d_counts,
-//    __global unsigned *d_offsets,
-//    __global unsigned *d_total,
-//    __global float *flags,
-//    __global const float* score,
-//    KParam iInfo,
-//    const unsigned edge)
-//{
-//    __local unsigned s_counts[256];
-//
-//    const int yid = get_group_id(1) * get_local_size(1) * 8 + get_local_id(1);
-//    const int yend = (get_group_id(1) + 1) * get_local_size(1) * 8;
-//    const int yoff = get_local_size(1);
-//
-//    unsigned count = 0;
-//
-//    const int max1 = (int)iInfo.dims[1] - edge - 1;
-//    for (int y = yid; y < yend; y += yoff) {
-//        if (y >= max1 || y <= (int)(edge+1)) continue;
-//
-//        const int xid = get_group_id(0) * get_local_size(0) * 2 + get_local_id(0);
-//        const int xend = (get_group_id(0) + 1) * get_local_size(0) * 2;
-//
-//        const int max0 = (int)iInfo.dims[0] - edge - 1;
-//        for (int x = xid; x < xend; x += get_local_size(0)) {
-//            if (x >= max0 || x <= (int)(edge+1)) continue;
-//
-//            float v = score[y * iInfo.dims[0] + x];
-//            if (v == 0) {
-//#if NONMAX
-//                flags[y * iInfo.dims[0] + x] = 0;
-//#endif
-//                continue;
-//            }
-//
-//#if NONMAX
-//                float max_v = v;
-//                max_v = MAX_VAL(score[x-1 + iInfo.dims[0] * (y-1)], score[x-1 + iInfo.dims[0] * y]);
-//                max_v = MAX_VAL(max_v, score[x-1 + iInfo.dims[0] * (y+1)]);
-//                max_v = MAX_VAL(max_v, score[x   + iInfo.dims[0] * (y-1)]);
-//                max_v = MAX_VAL(max_v, score[x   + iInfo.dims[0] * (y+1)]);
-//                max_v = MAX_VAL(max_v, score[x+1 + iInfo.dims[0] * (y-1)]);
-//                max_v = MAX_VAL(max_v, score[x+1 + iInfo.dims[0] * (y)  ]);
-//                max_v = MAX_VAL(max_v, score[x+1 + iInfo.dims[0] * (y+1)]);
-//
-//                v = (v > max_v) ? v : 0;
-//                flags[y * iInfo.dims[0] + x] = v;
-//                if (v == 0) continue;
-//#endif
-//
-//            count++;
-//        }
-//    }
-//
-//    const int tid = get_local_size(0) * get_local_id(1) + get_local_id(0);
-//
-//    s_counts[tid] = count;
-//    barrier(CLK_LOCAL_MEM_FENCE);
-//
-//    if (tid < 128) s_counts[tid] += s_counts[tid + 128]; barrier(CLK_LOCAL_MEM_FENCE);
-//    if (tid <  64) s_counts[tid] += s_counts[tid +  64]; barrier(CLK_LOCAL_MEM_FENCE);
-//    if (tid <  32) s_counts[tid] += s_counts[tid +  32]; barrier(CLK_LOCAL_MEM_FENCE);
-//    if (tid <  16) s_counts[tid] += s_counts[tid +  16]; barrier(CLK_LOCAL_MEM_FENCE);
-//    if (tid <   8) s_counts[tid] += s_counts[tid +   8]; barrier(CLK_LOCAL_MEM_FENCE);
-//    if (tid <   4) s_counts[tid] += s_counts[tid +   4]; barrier(CLK_LOCAL_MEM_FENCE);
-//    if (tid <   2) s_counts[tid] += s_counts[tid +   2]; barrier(CLK_LOCAL_MEM_FENCE);
-//    if (tid <   1) s_counts[tid] += s_counts[tid +   1]; barrier(CLK_LOCAL_MEM_FENCE);
-//
-//    if (tid == 0) {
-//        const int bid = get_group_id(1) * get_num_groups(0) + get_group_id(0);
-//        unsigned total = s_counts[0] ? atomic_add(d_total, s_counts[0]) : 0;
-//        d_counts [bid] = s_counts[0];
-//        d_offsets[bid] = total;
-//    }
-//}
-//
-//__kernel void get_features(
-//    __global float* x_out,
-//    __global float* y_out,
-//    __global float* score_out,
-//    __global const float* flags,
-//    __global const unsigned* d_counts,
-//    __global const unsigned* d_offsets,
-//    KParam iInfo,
-//    const unsigned total,
-//    const unsigned edge)
-//{
-//    const int xid = get_group_id(0) * get_local_size(0) * 2 + get_local_id(0);
-//    const int yid = get_group_id(1) * get_local_size(1) * 8 + get_local_id(1);
-//    const int tid = get_local_size(0) * get_local_id(1) + get_local_id(0);
-//
-//    const int xoff = get_local_size(0);
-//    const int yoff = get_local_size(1);
-//
-//    const int xend = (get_group_id(0) + 1) * get_local_size(0) * 2;
-//    const int yend = (get_group_id(1) + 1) * get_local_size(1) * 8;
-//
-//    const int bid = get_group_id(1) * get_num_groups(0) + get_group_id(0);
-//
-//    __local unsigned s_count;
-//    __local unsigned s_idx;
-//
-//    if (tid == 0) {
-//        s_count  = d_counts [bid];
-//        s_idx    = d_offsets[bid];
-//    }
-//    barrier(CLK_LOCAL_MEM_FENCE);
-//
-//    // Blocks that are empty, please bail
-//    if (s_count == 0) return;
-//    for (int y = yid; y < yend; y += yoff) {
-//        if (y >= iInfo.dims[1] - edge - 1 || y <= edge+1) continue;
-//        for (int x = xid; x < xend; x += xoff) {
-//            if (x >= iInfo.dims[0] - edge - 1 || x <= edge+1) continue;
-//
-//            float v = flags[y * iInfo.dims[0] + x];
-//            if (v == 0) continue;
-//
-//            unsigned id = atomic_inc(&s_idx);
-//            if (id < total) {
-//                y_out[id] = x;
-//                x_out[id] = y;
-//                score_out[id] = v;
-//            }
-//        }
-//    }
-//}
+// score_at()
+// Score of a neighbour, pixels outside the tested region are never written
+// by locate_features() and count as 0
+inline int score_at(__global const int* score, const int d0, const int d1,
+                    const unsigned edge, const int x, const int y)
+{
+    if (x < (int)edge || y < (int)edge || x >= d0 - (int)edge || y >= d1 - (int)edge)
+        return 0;
+    return score[x + d0 * y];
+}
+
+// non_max_counts()
+// Suppresses non-maximal scores into flags and counts the survivors of each
+// 64x64 block, reserving a range of the output list for every block
+__kernel __attribute__ ((reqd_work_group_size(FAST_THREADS_NONMAX_X, FAST_THREADS_NONMAX_Y, 1)))
+void non_max_counts(
+    __global unsigned *d_counts,
+    __global unsigned *d_offsets,
+    __global unsigned *d_total,
+    __global int *flags,
+    __global const int* score,
+    const int d0,
+    const int d1,
+    const unsigned edge)
+{
+    __local unsigned s_counts[FAST_THREADS_NONMAX_X * FAST_THREADS_NONMAX_Y];
+
+    const int yid = get_group_id(1) * get_local_size(1) * 8 + get_local_id(1);
+    const int yend = (get_group_id(1) + 1) * get_local_size(1) * 8;
+    const int yoff = get_local_size(1);
+
+    unsigned count = 0;
+
+    const int max1 = d1 - (int)edge;
+    for (int y = yid; y < yend; y += yoff) {
+        if (y >= max1 || y < (int)edge) continue;
+
+        const int xid = get_group_id(0) * get_local_size(0) * 2 + get_local_id(0);
+        const int xend = (get_group_id(0) + 1) * get_local_size(0) * 2;
+
+        const int max0 = d0 - (int)edge;
+        for (int x = xid; x < xend; x += get_local_size(0)) {
+            if (x >= max0 || x < (int)edge) continue;
+
+            int v = score[y * d0 + x];
+            if (v == 0) {
+#if NONMAX
+                flags[y * d0 + x] = 0;
+#endif
+                continue;
+            }
+
+#if NONMAX
+            int max_v = MAX_VAL(score_at(score, d0, d1, edge, x-1, y-1),
+                                score_at(score, d0, d1, edge, x-1, y));
+            max_v = MAX_VAL(max_v, score_at(score, d0, d1, edge, x-1, y+1));
+            max_v = MAX_VAL(max_v, score_at(score, d0, d1, edge, x,   y-1));
+            max_v = MAX_VAL(max_v, score_at(score, d0, d1, edge, x,   y+1));
+            max_v = MAX_VAL(max_v, score_at(score, d0, d1, edge, x+1, y-1));
+            max_v = MAX_VAL(max_v, score_at(score, d0, d1, edge, x+1, y));
+            max_v = MAX_VAL(max_v, score_at(score, d0, d1, edge, x+1, y+1));
+
+            v = (v > max_v) ? v : 0;
+            flags[y * d0 + x] = v;
+            if (v == 0) continue;
+#endif
+
+            count++;
+        }
+    }
+
+    const int tid = get_local_size(0) * get_local_id(1) + get_local_id(0);
+
+    s_counts[tid] = count;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (tid < 128) s_counts[tid] += s_counts[tid + 128]; barrier(CLK_LOCAL_MEM_FENCE);
+    if (tid <  64) s_counts[tid] += s_counts[tid +  64]; barrier(CLK_LOCAL_MEM_FENCE);
+    if (tid <  32) s_counts[tid] += s_counts[tid +  32]; barrier(CLK_LOCAL_MEM_FENCE);
+    if (tid <  16) s_counts[tid] += s_counts[tid +  16]; barrier(CLK_LOCAL_MEM_FENCE);
+    if (tid <   8) s_counts[tid] += s_counts[tid +   8]; barrier(CLK_LOCAL_MEM_FENCE);
+    if (tid <   4) s_counts[tid] += s_counts[tid +   4]; barrier(CLK_LOCAL_MEM_FENCE);
+    if (tid <   2) s_counts[tid] += s_counts[tid +   2]; barrier(CLK_LOCAL_MEM_FENCE);
+    if (tid <   1) s_counts[tid] += s_counts[tid +   1]; barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (tid == 0) {
+        const int bid = get_group_id(1) * get_num_groups(0) + get_group_id(0);
+        unsigned total = s_counts[0] ? atomic_add(d_total, s_counts[0]) : 0;
+        d_counts [bid] = s_counts[0];
+        d_offsets[bid] = total;
+    }
+}
+
+// get_features()
+// Writes the survivors of non_max_counts() as a compact list of (x, y, score)
+// triplets, launched with the same grid
+__kernel __attribute__ ((reqd_work_group_size(FAST_THREADS_NONMAX_X, FAST_THREADS_NONMAX_Y, 1)))
+void get_features(
+    __global int* features,
+    __global const int* flags,
+    __global const unsigned* d_counts,
+    __global const unsigned* d_offsets,
+    const int d0,
+    const int d1,
+    const unsigned max_features,
+    const unsigned edge)
+{
+    const int xid = get_group_id(0) * get_local_size(0) * 2 + get_local_id(0);
+    const int yid = get_group_id(1) * get_local_size(1) * 8 + get_local_id(1);
+    const int tid = get_local_size(0) * get_local_id(1) + get_local_id(0);
+
+    const int xoff = get_local_size(0);
+    const int yoff = get_local_size(1);
+
+    const int xend = (get_group_id(0) + 1) * get_local_size(0) * 2;
+    const int yend = (get_group_id(1) + 1) * get_local_size(1) * 8;
+
+    const int bid = get_group_id(1) * get_num_groups(0) + get_group_id(0);
+
+    __local unsigned s_count;
+    __local unsigned s_idx;
+
+    if (tid == 0) {
+        s_count  = d_counts [bid];
+        s_idx    = d_offsets[bid];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Blocks that are empty, please bail
+    if (s_count == 0) return;
+    for (int y = yid; y < yend; y += yoff) {
+        if (y >= d1 - (int)edge || y < (int)edge) continue;
+        for (int x = xid; x < xend; x += xoff) {
+            if (x >= d0 - (int)edge || x < (int)edge) continue;
+
+            int v = flags[y * d0 + x];
+            if (v == 0) continue;
+
+            unsigned id = atomic_inc(&s_idx);
+            if (id < max_features) {
+                features[3*id + 0] = x;
+                features[3*id + 1] = y;
+                features[3*id + 2] = v;
+            }
+        }
+    }
+}
@@ -0,0 +1,526 @@
+/*******************************************************
+ * Copyright (c) 2015, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#include "fastCpu.h"
+#include "threadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+
+// Target attributes and __builtin_cpu_supports() need GCC 4.9 or clang
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define FAST_CPU_X86 1
+#include <immintrin.h>
+#endif
+
+#define ARC_LENGTH 9
+
+// Circle offsets, in the same order as idx_x()/idx_y() in the kernels
+static const int circle_x[16] = { 0,  1,  2,  3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1 };
+static const int circle_y[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3,  3,  2,  1,  0, -1, -2, -3 };
+static const int pair_order[8] = { 0, 4, 2, 6, 1, 3, 5, 7 };
+
+struct fastBand {
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> score;
+};
+
+// Returns non-zero when mask has ARC_LENGTH contiguous bits set, including
+// segments that wrap around from bit 15 to bit 0
+static inline int has_arc(unsigned mask)
+{
+    unsigned m = mask | (mask << 16);
+    unsigned a = m & (m >> 1);
+    a &= a >> 2;
+    a &= a >> 4;
+    a &= m >> (ARC_LENGTH - 1);
+    return (a & 0xFFFF) != 0;
+}
+
+// Score of a pixel already known to pass the segment test
+template<typename T>
+static inline int score_value(const T* img, const int* offsets, const int thr)
+{
+    const int p = img[0];
+    int s_bright = 0, s_dark = 0;
+    for (int i = 0; i < 16; i++) {
+        int p_x = img[offsets[i]];
+        int weight = std::abs(p_x - p) - thr;
+        if (p_x >= p + thr)
+            s_bright += weight;
+        if (p_x <= p - thr)
+            s_dark += weight;
+    }
+    return std::max(s_bright, s_dark);
+}
+
+// Score of pixel img[0] with the given circle offsets, 0 if it is not a
+// feature. Same comparisons as test_pixel() in the kernels.
+template<typename T>
+static inline int corner_score(const T* img, const int* offsets, const int thr)
+{
+    const int p = img[0];
+
+    // Opposite pixels of the circle, an arc of 9 always contains at least
+    // one pixel of each pair. Cardinal pairs first, as in the kernels.
+    for (int i = 0; i < 8; i++) {
+        int a = img[offsets[pair_order[i]]];
+        int b = img[offsets[pair_order[i] + 8]];
+        if (a > p - thr && a < p + thr && b > p - thr && b < p + thr)
+            return 0;
+    }
+
+    unsigned bright = 0, dark = 0;
+    int s_bright = 0, s_dark = 0;
+    for (int i = 0; i < 16; i++) {
+        int p_x = img[offsets[i]];
+        int weight = std::abs(p_x - p) - thr;
+        if (p_x >= p + thr) {
+            bright |= 1u << i;
+            s_bright += weight;
+        }
+        if (p_x <= p - thr) {
+            dark |= 1u << i;
+            s_dark += weight;
+        }
+    }
+
+    // test_pixel() returns -1 when a pixel is both brighter and darker,
+    // which can only happen for thr <= 0
+    bright &= ~dark;
+
+    if (!has_arc(bright) && !has_arc(dark))
+        return 0;
+
+    return std::max(s_bright, s_dark);
+}
+
+// Scores of one image row. out must be all zeros on entry, only features
+// are written. Returns the number of features found.
+template<typename T>
+static int score_row(int* out, const T* img, const int w, const int y,
+                     const int* offsets, const int thr)
+{
+    const T* row = img + (size_t)y * w;
+    int count = 0;
+    for (int x = FAST_CPU_EDGE; x < w - FAST_CPU_EDGE; x++) {
+        int v = corner_score(row + x, offsets, thr);
+        if (v != 0) {
+            out[x] = v;
+            count++;
+        }
+    }
+    return count;
+}
+
+#ifdef FAST_CPU_X86
+
+// Bright and dark masks compare the saturated differences against thr,
+// which matches x >= p + thr and x <= p - thr for 0 < thr < 256. Arcs of
+// ARC_LENGTH are found by and-ing shifted masks: pairs, quadruples, runs of
+// 8 and finally the 9th pixel. The circle loops are unrolled by hand so the
+// masks stay in registers without relying on the optimization level.
+
+#define REP16(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+                 X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15)
+
+__attribute__((target("sse2")))
+static inline __m128i arc_sse2(const __m128i* m)
+{
+    __m128i a2[16], a4[16];
+    __m128i any = _mm_setzero_si128();
+#define ARC_A2(i) a2[i] = _mm_and_si128(m[i], m[((i) + 1) & 15]);
+#define ARC_A4(i) a4[i] = _mm_and_si128(a2[i], a2[((i) + 2) & 15]);
+#define ARC_A9(i) any = _mm_or_si128(any, _mm_and_si128(_mm_and_si128(a4[i], a4[((i) + 4) & 15]), \
+                                                        m[((i) + ARC_LENGTH - 1) & 15]));
+    REP16(ARC_A2)
+    REP16(ARC_A4)
+    REP16(ARC_A9)
+#undef ARC_A2
+#undef ARC_A4
+#undef ARC_A9
+    return any;
+}
+
+__attribute__((target("sse2")))
+static int score_row_sse2(int* out, const unsigned char* img, const int w, const int y,
+                          const int* offsets, const int thr)
+{
+    const unsigned char* row = img + (size_t)y * w;
+    const __m128i t = _mm_set1_epi8((char)thr);
+    const __m128i zero = _mm_setzero_si128();
+
+    int count = 0;
+    int x = FAST_CPU_EDGE;
+    for (; x + 16 <= w - FAST_CPU_EDGE; x += 16) {
+        const unsigned char* c = row + x;
+        const __m128i p = _mm_loadu_si128((const __m128i*)c);
+        __m128i b[16], d[16];
+
+#define MASKS(i) { __m128i v = _mm_loadu_si128((const __m128i*)(c + offsets[i])); \
+                  b[i] = _mm_cmpeq_epi8(_mm_subs_epu8(t, _mm_subs_epu8(v, p)), zero); \
+                  d[i] = _mm_cmpeq_epi8(_mm_subs_epu8(t, _mm_subs_epu8(p, v)), zero); }
+        MASKS(0) MASKS(4) MASKS(8) MASKS(12)
+
+        // Any arc of 9 contains two neighbouring cardinal pixels
+        __m128i cand = _mm_or_si128(
+            _mm_and_si128(_mm_or_si128(b[0], b[8]), _mm_or_si128(b[4], b[12])),
+            _mm_and_si128(_mm_or_si128(d[0], d[8]), _mm_or_si128(d[4], d[12])));
+        if (_mm_movemask_epi8(cand) == 0)
+            continue;
+
+        MASKS(1) MASKS(2) MASKS(3) MASKS(5) MASKS(6) MASKS(7)
+        MASKS(9) MASKS(10) MASKS(11) MASKS(13) MASKS(14) MASKS(15)
+#undef MASKS
+
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(arc_sse2(b), arc_sse2(d)));
+        while (mask) {
+            int k = __builtin_ctz(mask);
+            out[x + k] = score_value(c + k, offsets, thr);
+            count++;
+            mask &= mask - 1;
+        }
+    }
+
+    for (; x < w - FAST_CPU_EDGE; x++) {
+        int v = corner_score(row + x, offsets, thr);
+        if (v != 0) {
+            out[x] = v;
+            count++;
+        }
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i arc_avx2(const __m256i* m)
+{
+    __m256i a2[16], a4[16];
+    __m256i any = _mm256_setzero_si256();
+#define ARC_A2(i) a2[i] = _mm256_and_si256(m[i], m[((i) + 1) & 15]);
+#define ARC_A4(i) a4[i] = _mm256_and_si256(a2[i], a2[((i) + 2) & 15]);
+#define ARC_A9(i) any = _mm256_or_si256(any, _mm256_and_si256(_mm256_and_si256(a4[i], a4[((i) + 4) & 15]), \
+                                                              m[((i) + ARC_LENGTH - 1) & 15]));
+    REP16(ARC_A2)
+    REP16(ARC_A4)
+    REP16(ARC_A9)
+#undef ARC_A2
+#undef ARC_A4
+#undef ARC_A9
+    return any;
+}
+
+__attribute__((target("avx2")))
+static int score_row_avx2(int* out, const unsigned char* img, const int w, const int y,
+                          const int* offsets, const int thr)
+{
+    const unsigned char* row = img + (size_t)y * w;
+    const __m256i t = _mm256_set1_epi8((char)thr);
+    const __m256i zero = _mm256_setzero_si256();
+
+    int count = 0;
+    int x = FAST_CPU_EDGE;
+    for (; x + 32 <= w - FAST_CPU_EDGE; x += 32) {
+        const unsigned char* c = row + x;
+        const __m256i p = _mm256_loadu_si256((const __m256i*)c);
+        __m256i b[16], d[16];
+
+#define MASKS(i) { __m256i v = _mm256_loadu_si256((const __m256i*)(c + offsets[i])); \
+                  b[i] = _mm256_cmpeq_epi8(_mm256_subs_epu8(t, _mm256_subs_epu8(v, p)), zero); \
+                  d[i] = _mm256_cmpeq_epi8(_mm256_subs_epu8(t, _mm256_subs_epu8(p, v)), zero); }
+        MASKS(0) MASKS(4) MASKS(8) MASKS(12)
+
+        __m256i cand = _mm256_or_si256(
+            _mm256_and_si256(_mm256_or_si256(b[0], b[8]), _mm256_or_si256(b[4], b[12])),
+            _mm256_and_si256(_mm256_or_si256(d[0], d[8]), _mm256_or_si256(d[4], d[12])));
+        if (_mm256_movemask_epi8(cand) == 0)
+            continue;
+
+        MASKS(1) MASKS(2) MASKS(3) MASKS(5) MASKS(6) MASKS(7)
+        MASKS(9) MASKS(10) MASKS(11) MASKS(13) MASKS(14) MASKS(15)
+#undef MASKS
+
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(arc_avx2(b), arc_avx2(d)));
+        while (mask) {
+            int k = __builtin_ctz(mask);
+            out[x + k] = score_value(c + k, offsets, thr);
+            count++;
+            mask &= mask - 1;
+        }
+    }
+
+    for (; x < w - FAST_CPU_EDGE; x++) {
+        int v = corner_score(row + x, offsets, thr);
+        if (v != 0) {
+            out[x] = v;
+            count++;
+        }
+    }
+    return count;
+}
+
+#endif
+
+static FastCpuSimd detect_simd()
+{
+#ifdef FAST_CPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return FAST_CPU_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return FAST_CPU_SSE2;
+#endif
+    return FAST_CPU_SCALAR;
+}
+
+static const FastCpuSimd simd_supported = detect_simd();
+// Set by fastCpuSetSimd() while pool threads may be scoring rows
+static std::atomic<FastCpuSimd> simd_active(simd_supported);
+
+// 8-bit rows go through the widest instruction set available
+static int score_row(int* out, const unsigned char* img, const int w, const int y,
+                     const int* offsets, const int thr)
+{
+#ifdef FAST_CPU_X86
+    if (thr > 0 && thr < 256) {
+        switch (simd_active.load(std::memory_order_relaxed)) {
+        case FAST_CPU_AVX2:
+            return score_row_avx2(out, img, w, y, offsets, thr);
+        case FAST_CPU_SSE2:
+            return score_row_sse2(out, img, w, y, offsets, thr);
+        default:
+            break;
+        }
+    }
+#endif
+    return score_row<unsigned char>(out, img, w, y, offsets, thr);
+}
+
+// Detects features on rows [y0, y1). Scores are kept for three rows at a
+// time, rows y0-1 and y1 form the halo needed by the non-maximal suppression.
+// Rows without any feature are neither cleared nor scanned again.
+template<typename T>
+static void detect_band(fastBand& out, const T* img, const int w, const int h,
+                        const int y0, const int y1, const int* offsets, const int thr)
+{
+    const int ybeg = FAST_CPU_EDGE;
+    const int yend = h - FAST_CPU_EDGE;
+
+    std::vector<int> rows(3 * w, 0);
+    int* prev = &rows[0];
+    int* cur  = &rows[w];
+    int* next = &rows[2 * w];
+    int prevCount = 0, curCount = 0, nextCount = 0;
+
+    if (y0 - 1 >= ybeg)
+        prevCount = score_row(prev, img, w, y0 - 1, offsets, thr);
+    curCount = score_row(cur, img, w, y0, offsets, thr);
+
+    for (int y = y0; y < y1; y++) {
+        if (nextCount != 0)
+            std::fill(next, next + w, 0);
+        nextCount = (y + 1 < yend) ? score_row(next, img, w, y + 1, offsets, thr) : 0;
+
+        for (int x = FAST_CPU_EDGE; curCount != 0 && x < w - FAST_CPU_EDGE; x++) {
+            int v = cur[x];
+            if (v == 0)
+                continue;
+
+            int max_v = std::max(prev[x-1], prev[x]);
+            max_v = std::max(max_v, prev[x+1]);
+            max_v = std::max(max_v, cur[x-1]);
+            max_v = std::max(max_v, cur[x+1]);
+            max_v = std::max(max_v, next[x-1]);
+            max_v = std::max(max_v, next[x]);
+            max_v = std::max(max_v, next[x+1]);
+            if (v > max_v) {
+                out.x.push_back(x);
+                out.y.push_back(y);
+                out.score.push_back(v);
+            }
+        }
+
+        int* tmp = prev;
+        prev = cur;
+        cur = next;
+        next = tmp;
+
+        int tmpCount = prevCount;
+        prevCount = curCount;
+        curCount = nextCount;
+        nextCount = tmpCount;
+    }
+}
+
+template<typename T>
+static int fast_cpu(std::vector<int>& x, std::vector<int>& y, std::vector<int>& score,
+                    const T* img, const int w, const int h, const int thr, unsigned nthreads)
+{
+    x.clear();
+    y.clear();
+    score.clear();
+
+    if (!img || w <= 0 || h <= 0)
+        return -1;
+
+    const int ybeg = FAST_CPU_EDGE;
+    const int yend = h - FAST_CPU_EDGE;
+    if (w <= 2 * FAST_CPU_EDGE || yend <= ybeg)
+        return 0;
+
+    int offsets[16];
+    for (int i = 0; i < 16; i++)
+        offsets[i] = circle_y[i] * w + circle_x[i];
+
+    ThreadPool& pool = ThreadPool::global();
+    unsigned threads = (nthreads == 0) ? pool.size() : std::min(nthreads, pool.size());
+
+    // A few bands per thread keep the load balanced when features are
+    // concentrated in some part of the image
+    const int rows = yend - ybeg;
+    int nbands = std::max(1, std::min((int)threads * 4, rows / FAST_CPU_MIN_BAND));
+    const int bandRows = (rows + nbands - 1) / nbands;
+    nbands = (rows + bandRows - 1) / bandRows;
+
+    std::vector<fastBand> bands(nbands);
+    pool.run(nbands, [&](unsigned b) {
+        int y0 = ybeg + (int)b * bandRows;
+        int y1 = std::min(y0 + bandRows, yend);
+        detect_band(bands[b], img, w, h, y0, y1, offsets, thr);
+    }, threads);
+
+    size_t total = 0;
+    for (int b = 0; b < nbands; b++)
+        total += bands[b].x.size();
+
+    x.reserve(total);
+    y.reserve(total);
+    score.reserve(total);
+    for (int b = 0; b < nbands; b++) {
+        x.insert(x.end(), bands[b].x.begin(), bands[b].x.end());
+        y.insert(y.end(), bands[b].y.begin(), bands[b].y.end());
+        score.insert(score.end(), bands[b].score.begin(), bands[b].score.end());
+    }
+
+    return 0;
+}
+
+int fastCpu(std::vector<int>& x, std::vector<int>& y, std::vector<int>& score,
+            const int* img, const int w, const int h, const int thr,
+            unsigned nthreads)
+{
+    return fast_cpu(x, y, score, img, w, h, thr, nthreads);
+}
+
+int fastCpu(std::vector<int>& x, std::vector<int>& y, std::vector<int>& score,
+            const unsigned char* img, const int w, const int h, const int thr,
+            unsigned nthreads)
+{
+    return fast_cpu(x, y, score, img, w, h, thr, nthreads);
+}
+
+// Strength of pixel img[0], see strength_core() in fast.cl
+template<typename T>
+static inline int strength_value(const T* img, const int* offsets)
+{
+    const int p = img[0];
+    int diff[16];
+    for (int i = 0; i < 16; i++)
+        diff[i] = img[offsets[i]] - p;
+
+    int s_bright = 0, s_dark = 0;
+    for (int i = 0; i < 16; i++) {
+        int min_bright = diff[i], min_dark = -diff[i];
+        for (int j = 1; j < ARC_LENGTH; j++) {
+            min_bright = std::min(min_bright, diff[(i + j) & 15]);
+            min_dark = std::min(min_dark, -diff[(i + j) & 15]);
+        }
+        s_bright = std::max(s_bright, min_bright);
+        s_dark = std::max(s_dark, min_dark);
+    }
+    return std::max(s_bright, s_dark);
+}
+
+template<typename T>
+static int fast_cpu_strength(std::vector<int>& strength, const T* img, const int w, const int h,
+                             unsigned nthreads)
+{
+    if (!img || w <= 0 || h <= 0)
+        return -1;
+
+    strength.assign((size_t)w * h, 0);
+
+    const int ybeg = FAST_CPU_EDGE;
+    const int yend = h - FAST_CPU_EDGE;
+    if (w <= 2 * FAST_CPU_EDGE || yend <= ybeg)
+        return 0;
+
+    int offsets[16];
+    for (int i = 0; i < 16; i++)
+        offsets[i] = circle_y[i] * w + circle_x[i];
+
+    ThreadPool& pool = ThreadPool::global();
+    unsigned threads = (nthreads == 0) ? pool.size() : std::min(nthreads, pool.size());
+
+    const int rows = yend - ybeg;
+    int nbands = std::max(1, std::min((int)threads * 4, rows / FAST_CPU_MIN_BAND));
+    const int bandRows = (rows + nbands - 1) / nbands;
+    nbands = (rows + bandRows - 1) / bandRows;
+
+    pool.run(nbands, [&](unsigned b) {
+        int y0 = ybeg + (int)b * bandRows;
+        int y1 = std::min(y0 + bandRows, yend);
+        for (int y = y0; y < y1; y++) {
+            const T* row = img + (size_t)y * w;
+            int* out = &strength[(size_t)y * w];
+            for (int x = FAST_CPU_EDGE; x < w - FAST_CPU_EDGE; x++)
+                out[x] = strength_value(row + x, offsets);
+        }
+    }, threads);
+
+    return 0;
+}
+
+int fastCpuStrength(std::vector<int>& strength, const int* img, const int w, const int h,
+                    unsigned nthreads)
+{
+    return fast_cpu_strength(strength, img, w, h, nthreads);
+}
+
+int fastCpuStrength(std::vector<int>& strength, const unsigned char* img, const int w, const int h,
+                    unsigned nthreads)
+{
+    return fast_cpu_strength(strength, img, w, h, nthreads);
+}
+
+FastCpuSimd fastCpuSimd()
+{
+    return simd_active.load();
+}
+
+FastCpuSimd fastCpuSetSimd(FastCpuSimd simd)
+{
+    const FastCpuSimd active = std::min(simd, simd_supported);
+    simd_active.store(active);
+    return active;
+}
+
+const char* fastCpuSimdName(FastCpuSimd simd)
+{
+    switch (simd) {
+    case FAST_CPU_AVX2:
+        return "AVX2";
+    case FAST_CPU_SSE2:
+        return "SSE2";
+    default:
+        return "scalar";
+    }
+}
@@ -0,0 +1,65 @@
+/*******************************************************
+ * Copyright (c) 2015, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#ifndef _FAST_CPU_H_
+#define _FAST_CPU_H_
+
+#include <vector>
+
+// Native host implementation of the locate_features kernels: FAST segment
+// test with an arc of 9 contiguous pixels followed by a 3x3 non-maximal
+// suppression. Output matches the score map read back from the device,
+// scanned in row-major order.
+
+// Radius of the circle, pixels closer than this to the border are not tested
+const int FAST_CPU_EDGE = 3;
+
+// Minimum number of rows handed to a single thread
+const int FAST_CPU_MIN_BAND = 16;
+
+// Instruction sets used by the segment test on 8-bit images
+enum FastCpuSimd
+{
+    FAST_CPU_SCALAR,
+    FAST_CPU_SSE2,      // 16 pixels per step
+    FAST_CPU_AVX2       // 32 pixels per step
+};
+
+// Returns 0 on success and -1 on invalid arguments. nthreads == 0 uses the
+// whole process wide thread pool.
+int fastCpu(std::vector<int>& x, std::vector<int>& y, std::vector<int>& score,
+            const int* img, const int w, const int h, const int thr,
+            unsigned nthreads = 0);
+
+// 8-bit version, vectorized when the CPU supports it and 0 < thr < 256
+int fastCpu(std::vector<int>& x, std::vector<int>& y, std::vector<int>& score,
+            const unsigned char* img, const int w, const int h, const int thr,
+            unsigned nthreads = 0);
+
+// Strength map: for every pixel the highest threshold at which it still
+// passes the segment test, 0 for pixels that never do and on the border.
+// A pixel passes with thr > 0 exactly when its strength is >= thr, so
+// candidates for any threshold are a filter over the map. Same values as
+// the strength_map kernel. Returns 0 on success and -1 on invalid arguments.
+int fastCpuStrength(std::vector<int>& strength, const int* img, const int w, const int h,
+                    unsigned nthreads = 0);
+
+int fastCpuStrength(std::vector<int>& strength, const unsigned char* img, const int w, const int h,
+                    unsigned nthreads = 0);
+
+// Instruction set picked at startup, the best one supported by the CPU
+FastCpuSimd fastCpuSimd();
+
+// Restricts the 8-bit path to at most the given instruction set, returns
+// the one that will actually be used
+FastCpuSimd fastCpuSetSimd(FastCpuSimd simd);
+
+const char* fastCpuSimdName(FastCpuSimd simd);
+
+#endif
@@ -15,8 +15,25 @@
 #define ARC_LENGTH 9
 #define NONMAX 1
 #define EDGE 3
+// With 8-bit pixels local_image takes a quarter of the local memory it used
+// to, LOCAL_LINES can be raised accordingly when building the binary
+#ifndef LOCAL_LINES
 #define LOCAL_LINES 16
+#endif
+// Widest stripe, halo included, the kernel processes at once. Wider images
+// are processed as several stripes of columns. Builds from source can
+// specialize it with -DWIDTH=<stripe width>.
+#ifndef WIDTH
 #define WIDTH 640
+#endif
+// Columns read on each side of a stripe, the circle radius
+#define HALO EDGE
+
+// Grayscale pixels are 8-bit, build with -DPIXEL_TYPE=int for hosts that
+// still upload 32-bit pixels
+#ifndef PIXEL_TYPE
+#define PIXEL_TYPE uchar
+#endif
 
 #define MAX_VAL(A,B) (A<B) ? (B) : (A)
 
@@ -32,9 +49,9 @@ inline int idx_x(const int i)
     return idx_y((i + 4) & 15);
 }
 
-inline int idx(const int x, const int y)
+inline int idx(const int stride, const int x, const int y)
 {
-    return y * WIDTH + x;
+    return y * stride + x;
 }
 
 // test_greater()
@@ -55,59 +72,93 @@ inline int test_smaller(const int x, const int p, const int thr)
 // Returns -1 when x < p - thr
 // Returns  0 when x >= p - thr && x <= p + thr
 // Returns  1 when x > p + thr
-inline int test_pixel(__local int* local_image, const int p, const int thr, const int x, const int y)
+inline int test_pixel(__local PIXEL_TYPE* local_image, const int stride, const int p, const int thr, const int x, const int y)
+{
+    return -test_smaller(local_image[idx(stride,x,y)], p, thr) | test_greater(local_image[idx(stride,x,y)], p, thr);
+}
+
+// Appends a feature to the compact (x, y, score) list. The count keeps going
+// past max_features so the host can tell the list was truncated.
+inline void append_feature(__global int* features, __global unsigned* count,
+                           const unsigned max_features, const int x, const int y, const int v)
 {
-    return -test_smaller(local_image[idx(x,y)], p, thr) | test_greater(local_image[idx(x,y)], p, thr);
+    unsigned id = atomic_inc(count);
+    if (id < max_features) {
+        features[3*id + 0] = x;
+        features[3*id + 1] = y;
+        features[3*id + 2] = v;
+    }
 }
 
 __kernel __attribute__ ((reqd_work_group_size(FAST_THREADS_X, FAST_THREADS_Y, 1)))
 void locate_features(
-    __global int *in,
+    __global PIXEL_TYPE *in,
     const int d0,
     const int d1,
-    __global int* score,
+    const int x0,
+    const int stripe,
+    __global int *features,
+    __global unsigned *count,
+    const unsigned max_features,
     const int thr,
     const unsigned edge)
 {
+    // Only columns [x0, x0 + stripe) are reported, the halo around them is
+    // read so the results match a run over the whole width
+    const int lx0 = max(x0 - HALO, 0);
+    const int lx1 = min(x0 + stripe + HALO, d0);
+    const int lw = lx1 - lx0;
+
+    // Stripes wider than the local buffers cannot be processed, the host
+    // splits the image according to the width the kernel was built for
+    if (lw > WIDTH || lw <= 0)
+        return;
+
 #ifdef __xilinx__
     __attribute__((xcl_pipeline_workitems)) {
 #endif
-    __local int local_image[(LOCAL_LINES + EDGE*2) * WIDTH];
+    __local PIXEL_TYPE local_image[(LOCAL_LINES + EDGE*2) * WIDTH];
 
     for (int i = EDGE; i < d1 - EDGE; i += LOCAL_LINES) {
-        size_t gidx = (i-3) * WIDTH;
-        size_t copy_size = ((i-3 + LOCAL_LINES+EDGE*2) > d1)
-                           ? (d1-i+EDGE)*WIDTH
-                           : (LOCAL_LINES+EDGE*2)*WIDTH;
-        event_t ev;
-        ev = async_work_group_copy(local_image, in + gidx, copy_size, 0);
+        int rows = ((i-3 + LOCAL_LINES+EDGE*2) > d1)
+                   ? (d1-i+EDGE)
+                   : (LOCAL_LINES+EDGE*2);
+        // The rows of the stripe are not contiguous, each is copied on its
+        // own. The copies share one event so they overlap and are waited for
+        // once per block.
+        event_t ev = 0;
+        for (int r = 0; r < rows; r++)
+            ev = async_work_group_copy(local_image + r * lw, in + (i-3+r) * d0 + lx0, lw, ev);
         wait_group_events(1, &ev);
 
-        for (int ii = 0; ii < LOCAL_LINES; ii++) {
-            for (int j = EDGE; j < d0 - EDGE; j++) {
+        // The last block may hold fewer rows, the rest of local_image is
+        // left over from the previous one
+        const int lines = min(LOCAL_LINES, d1 - EDGE - i);
+        for (int ii = 0; ii < lines; ii++) {
+            for (int j = max(EDGE, x0); j < min(d0 - EDGE, x0 + stripe); j++) {
                 int x = j;
                 int y = i + ii;
-                int lx = x;
+                int lx = x - lx0;
                 int ly = ii + 3;
 
-                int p = local_image[idx(lx, ly)];
+                int p = local_image[idx(lw, lx, ly)];
 
                 // Start by testing opposite pixels of the circle that will result in
                 // a non-kepoint
-                int d = test_pixel(local_image, p, thr, lx-3, ly+0) | test_pixel(local_image, p, thr, lx+3, ly+0);
+                int d = test_pixel(local_image, lw, p, thr, lx-3, ly+0) | test_pixel(local_image, lw, p, thr, lx+3, ly+0);
                 if (d == 0)
                     continue;
 
-                d &= test_pixel(local_image, p, thr, lx-2, ly+2) | test_pixel(local_image, p, thr, lx+2, ly-2);
-                d &= test_pixel(local_image, p, thr, lx+0, ly+3) | test_pixel(local_image, p, thr, lx+0, ly-3);
-                d &= test_pixel(local_image, p, thr, lx+2, ly+2) | test_pixel(local_image, p, thr, lx-2, ly-2);
+                d &= test_pixel(local_image, lw, p, thr, lx-2, ly+2) | test_pixel(local_image, lw, p, thr, lx+2, ly-2);
+                d &= test_pixel(local_image, lw, p, thr, lx+0, ly+3) | test_pixel(local_image, lw, p, thr, lx+0, ly-3);
+                d &= test_pixel(local_image, lw, p, thr, lx+2, ly+2) | test_pixel(local_image, lw, p, thr, lx-2, ly-2);
                 if (d == 0)
                     continue;
 
-                d &= test_pixel(local_image, p, thr, lx-3, ly+1) | test_pixel(local_image, p, thr, lx+3, ly-1);
-                d &= test_pixel(local_image, p, thr, lx-1, ly+3) | test_pixel(local_image, p, thr, lx+1, ly-3);
-                d &= test_pixel(local_image, p, thr, lx+1, ly+3) | test_pixel(local_image, p, thr, lx-1, ly-3);
-                d &= test_pixel(local_image, p, thr, lx+3, ly+1) | test_pixel(local_image, p, thr, lx-3, ly-1);
+                d &= test_pixel(local_image, lw, p, thr, lx-3, ly+1) | test_pixel(local_image, lw, p, thr, lx+3, ly-1);
+                d &= test_pixel(local_image, lw, p, thr, lx-1, ly+3) | test_pixel(local_image, lw, p, thr, lx+1, ly-3);
+                d &= test_pixel(local_image, lw, p, thr, lx+1, ly+3) | test_pixel(local_image, lw, p, thr, lx-1, ly-3);
+                d &= test_pixel(local_image, lw, p, thr, lx+3, ly+1) | test_pixel(local_image, lw, p, thr, lx-3, ly-1);
                 if (d == 0)
                     continue;
 
@@ -118,7 +169,7 @@ void locate_features(
                 __attribute__((opencl_unroll_hint))
                 #endif
                 for (int i = 0; i < ARC_LENGTH; i++)
-                    sum += test_pixel(local_image, p, thr, lx+idx_x(i), ly+idx_y(i));
+                    sum += test_pixel(local_image, lw, p, thr, lx+idx_x(i), ly+idx_y(i));
 
                 // Test maximum and mininmum responses of first segment of ARC_LENGTH
                 // pixels
@@ -131,8 +182,8 @@ void locate_features(
                 __attribute__((opencl_unroll_hint))
                 #endif
                 for (int i = ARC_LENGTH; i < 16; i++) {
-                    sum -= test_pixel(local_image, p, thr, lx+idx_x(i-ARC_LENGTH), ly+idx_y(i-ARC_LENGTH));
-                    sum += test_pixel(local_image, p, thr, lx+idx_x(i), ly+idx_y(i));
+                    sum -= test_pixel(local_image, lw, p, thr, lx+idx_x(i-ARC_LENGTH), ly+idx_y(i-ARC_LENGTH));
+                    sum += test_pixel(local_image, lw, p, thr, lx+idx_x(i), ly+idx_y(i));
                     max_sum = max(max_sum, sum);
                     min_sum = min(min_sum, sum);
                 }
@@ -143,8 +194,8 @@ void locate_features(
                 __attribute__((opencl_unroll_hint))
                 #endif
                 for (int i = 0; i < ARC_LENGTH-1; i++) {
-                    sum -= test_pixel(local_image, p, thr, lx+idx_x(16-ARC_LENGTH+i), ly+idx_y(16-ARC_LENGTH+i));
-                    sum += test_pixel(local_image, p, thr, lx+idx_x(i), ly+idx_y(i));
+                    sum -= test_pixel(local_image, lw, p, thr, lx+idx_x(16-ARC_LENGTH+i), ly+idx_y(16-ARC_LENGTH+i));
+                    sum += test_pixel(local_image, lw, p, thr, lx+idx_x(i), ly+idx_y(i));
                     max_sum = max(max_sum, sum);
                     min_sum = min(min_sum, sum);
                 }
@@ -160,13 +211,13 @@ void locate_features(
                     __attribute__((opencl_unroll_hint))
                     #endif
                     for (int i = 0; i < 16; i++) {
-                        int p_x    = local_image[lx+idx(idx_x(i), ly+idx_y(i))];
+                        int p_x    = local_image[lx+idx(lw, idx_x(i), ly+idx_y(i))];
                         int weight = abs((int)p_x - (int)p) - thr;
                         s_bright += test_greater(p_x, p, thr) * weight;
                         s_dark   += test_smaller(p_x, p, thr) * weight;
                     }
 
-                    score[x + d0 * y] = MAX_VAL(s_bright, s_dark);
+                    append_feature(features, count, max_features, x, y, MAX_VAL(s_bright, s_dark));
                 }
             }
         }
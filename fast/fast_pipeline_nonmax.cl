@@ -15,12 +15,42 @@
 #define ARC_LENGTH 9
 #define NONMAX 1
 #define EDGE 3
+// Rows processed per step. With 8-bit pixels local_image takes a quarter of
+// the local memory it used to, LOCAL_LINES can be raised accordingly when
+// building the binary
+#ifndef LOCAL_LINES
 #define LOCAL_LINES 17
-#define NONMAX_LINES 16
+#endif
+// Rows of a line buffer: the step plus the circle above and below it
+#define IMAGE_LINES (LOCAL_LINES + EDGE*2)
+// Score rows: the step plus the two rows before it, kept from the previous
+// step for the non-maximal suppression of its last row
+#define SCORE_LINES (LOCAL_LINES + 2)
+// Widest stripe, halo included, the kernel processes at once. Wider images
+// are processed as several stripes of columns. Builds from source can
+// specialize it with -DWIDTH=<stripe width>.
+#ifndef WIDTH
 #define WIDTH 640
+#endif
+// Columns read on each side of a stripe: the circle radius, plus one for the
+// scores the non-maximal suppression compares against
+#define HALO (EDGE + 1)
+
+// Grayscale pixels are 8-bit, build with -DPIXEL_TYPE=int for hosts that
+// still upload 32-bit pixels
+#ifndef PIXEL_TYPE
+#define PIXEL_TYPE uchar
+#endif
 
 #define MAX_VAL(A,B) (A<B) ? (B) : (A)
 
+// BT.709 luma weights in 1.15 fixed point, the same as FAST_GRAY_* on the
+// host
+#define GRAY_SHIFT 15
+#define GRAY_R 6966
+#define GRAY_G 23436
+#define GRAY_B 2366
+
 inline int idx_y(const int i)
 {
     int j = i - 4;
@@ -33,9 +63,9 @@ inline int idx_x(const int i)
     return idx_y((i + 4) & 15);
 }
 
-inline int idx(const int x, const int y)
+inline int idx(const int stride, const int x, const int y)
 {
-    return y * WIDTH + x;
+    return y * stride + x;
 }
 
 // test_greater()
@@ -56,64 +86,129 @@ inline int test_smaller(const int x, const int p, const int thr)
 // Returns -1 when x < p - thr
 // Returns  0 when x >= p - thr && x <= p + thr
 // Returns  1 when x > p + thr
-inline int test_pixel(__local int* local_image, const int p, const int thr, const int x, const int y)
+inline int test_pixel(__local PIXEL_TYPE* local_image, const int stride, const int p, const int thr, const int x, const int y)
 {
-    return -test_smaller(local_image[idx(x,y)], p, thr) | test_greater(local_image[idx(x,y)], p, thr);
+    return -test_smaller(local_image[idx(stride,x,y)], p, thr) | test_greater(local_image[idx(stride,x,y)], p, thr);
 }
 
-__kernel __attribute__ ((reqd_work_group_size(FAST_THREADS_X, FAST_THREADS_Y, 1)))
-void locate_features(
-    __global int *in,
+// Appends a feature to the compact (x, y, score) list. The count keeps going
+// past max_features so the host can tell the list was truncated.
+inline void append_feature(__global int* features, __global unsigned* count,
+                           const unsigned max_features, const int x, const int y, const int v)
+{
+    unsigned id = atomic_inc(count);
+    if (id < max_features) {
+        features[3*id + 0] = x;
+        features[3*id + 1] = y;
+        features[3*id + 2] = v;
+    }
+}
+
+// Copies n pixels starting at offset to local memory. When rgb is set the
+// packed 0xAARRGGBB pixels it points to are converted to luma on the way
+// instead, and no event is added.
+inline event_t load_row(__local PIXEL_TYPE* dst, __global PIXEL_TYPE* in, __global const uint* rgb,
+                        const int offset, const int n, event_t ev)
+{
+    if (rgb) {
+        for (int j = 0; j < n; j++) {
+            uint px = rgb[offset + j];
+            dst[j] = (((px >> 16) & 0xff) * GRAY_R + ((px >> 8) & 0xff) * GRAY_G +
+                      (px & 0xff) * GRAY_B + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT;
+        }
+        return ev;
+    }
+    return async_work_group_copy(dst, in + offset, n, ev);
+}
+
+// Body of both kernels, reading gray pixels from in or packed color ones
+// from rgb
+inline void find_features(
+    __global PIXEL_TYPE *in,
+    __global const uint *rgb,
     const int d0,
     const int d1,
-    __global int *score,
+    const int x0,
+    const int stripe,
+    __global int *features,
+    __global unsigned *count,
+    const unsigned max_features,
     const int thr,
-    const unsigned edge)
+    __local PIXEL_TYPE *local_image,
+    __local int *local_score)
 {
-#ifdef __xilinx__
-    __attribute__((xcl_pipeline_workitems)) {
-#endif
-    __local int local_image[((LOCAL_LINES + EDGE*2) * WIDTH)];
-    __local int local_score[((NONMAX_LINES + EDGE*2) * WIDTH)];
-
-    for (int i = EDGE; i < d1 - EDGE; i += LOCAL_LINES) {
-        size_t gidx = ((i-3) * WIDTH);
-        size_t copy_size = ((i-3 + LOCAL_LINES+EDGE*2) > d1)
-                           ? (d1-i+EDGE)*WIDTH
-                           : (LOCAL_LINES+EDGE*2)*WIDTH;
-        event_t ev;
-        ev = async_work_group_copy(local_image, in + gidx, copy_size, 0);
+    // Only columns [x0, x0 + stripe) are reported, the halo around them is
+    // read so the results match a run over the whole width
+    const int lx0 = max(x0 - HALO, 0);
+    const int lx1 = min(x0 + stripe + HALO, d0);
+    const int lw = lx1 - lx0;
+
+    // Stripes wider than the local buffers cannot be processed, the host
+    // splits the image according to the width the kernel was built for
+    if (lw > WIDTH || lw <= 0)
+        return;
+
+    for (int j = 0; j < SCORE_LINES * lw; j++) {
+        local_score[j] = 0;
+    }
+
+    event_t ev = 0;
+    int rows = min(IMAGE_LINES, d1);
+    for (int r = 0; r < rows; r++) {
+        ev = load_row(local_image + r * lw, in, rgb, r * d0 + lx0, lw, ev);
+    }
+    if (!rgb)
         wait_group_events(1, &ev);
 
-        for (int j = 0; j < ((NONMAX_LINES + EDGE*2) * WIDTH); j++) {
+    // Scores of row y are computed in the step containing y and suppressed
+    // in the next one, once the row below is known, so the loop runs one
+    // step past the last tested row
+    int cur = 0;
+    for (int i = EDGE; i <= d1 - EDGE; i += LOCAL_LINES) {
+        __local PIXEL_TYPE* image = local_image + cur * IMAGE_LINES * WIDTH;
+        __local PIXEL_TYPE* next = local_image + (1 - cur) * IMAGE_LINES * WIDTH;
+
+        // Rows i+LOCAL_LINES+EDGE onwards are only needed by the next step
+        ev = 0;
+        int first = i + LOCAL_LINES + EDGE;
+        rows = min(LOCAL_LINES, d1 - first);
+        for (int r = 0; r < rows; r++) {
+            ev = load_row(next + (EDGE*2 + r) * lw, in, rgb, (first + r) * d0 + lx0, lw, ev);
+        }
+
+        // Slide the last two score rows of the previous step to the top
+        for (int j = 0; j < 2 * lw; j++) {
+            local_score[j] = local_score[LOCAL_LINES * lw + j];
+        }
+        for (int j = 2 * lw; j < SCORE_LINES * lw; j++) {
             local_score[j] = 0;
         }
 
-        for (int ii = 0; ii < LOCAL_LINES; ii++) {
-            for (int j = EDGE; j < d0 - EDGE; j++) {
+        for (int ii = 0; ii < LOCAL_LINES && i + ii < d1 - EDGE; ii++) {
+            for (int j = max(EDGE, lx0 + EDGE); j < min(d0 - EDGE, lx1 - EDGE); j++) {
                 int x = j;
                 int y = i + ii;
-                int lx = x;
+                int lx = x - lx0;
                 int ly = ii + 3;
 
-                int p = local_image[idx(lx, ly)];
+                int p = image[idx(lw, lx, ly)];
 
                 // Start by testing opposite pixels of the circle that will result in
                 // a non-kepoint
-                int d = test_pixel(local_image, p, thr, lx-3, ly+0) | test_pixel(local_image, p, thr, lx+3, ly+0);
+                int d = test_pixel(image, lw, p, thr, lx-3, ly+0) | test_pixel(image, lw, p, thr, lx+3, ly+0);
                 if (d == 0)
                     continue;
 
-                d &= test_pixel(local_image, p, thr, lx-2, ly+2) | test_pixel(local_image, p, thr, lx+2, ly-2);
-                d &= test_pixel(local_image, p, thr, lx+0, ly+3) | test_pixel(local_image, p, thr, lx+0, ly-3);
-                d &= test_pixel(local_image, p, thr, lx+2, ly+2) | test_pixel(local_image, p, thr, lx-2, ly-2);
+                d &= test_pixel(image, lw, p, thr, lx-2, ly+2) | test_pixel(image, lw, p, thr, lx+2, ly-2);
+                d &= test_pixel(image, lw, p, thr, lx+0, ly+3) | test_pixel(image, lw, p, thr, lx+0, ly-3);
+                d &= test_pixel(image, lw, p, thr, lx+2, ly+2) | test_pixel(image, lw, p, thr, lx-2, ly-2);
                 if (d == 0)
                     continue;
 
-                d &= test_pixel(local_image, p, thr, lx-3, ly+1) | test_pixel(local_image, p, thr, lx+3, ly-1);
-                d &= test_pixel(local_image, p, thr, lx-1, ly+3) | test_pixel(local_image, p, thr, lx+1, ly-3);
-                d &= test_pixel(local_image, p, thr, lx+1, ly+3) | test_pixel(local_image, p, thr, lx-1, ly-3);
-                d &= test_pixel(local_image, p, thr, lx+3, ly+1) | test_pixel(local_image, p, thr, lx-3, ly-1);
+                d &= test_pixel(image, lw, p, thr, lx-3, ly+1) | test_pixel(image, lw, p, thr, lx+3, ly-1);
+                d &= test_pixel(image, lw, p, thr, lx-1, ly+3) | test_pixel(image, lw, p, thr, lx+1, ly-3);
+                d &= test_pixel(image, lw, p, thr, lx+1, ly+3) | test_pixel(image, lw, p, thr, lx-1, ly-3);
+                d &= test_pixel(image, lw, p, thr, lx+3, ly+1) | test_pixel(image, lw, p, thr, lx-3, ly-1);
                 if (d == 0)
                     continue;
 
@@ -124,7 +219,7 @@ void locate_features(
                 __attribute__((opencl_unroll_hint))
                 #endif
                 for (int i = 0; i < ARC_LENGTH; i++)
-                    sum += test_pixel(local_image, p, thr, lx+idx_x(i), ly+idx_y(i));
+                    sum += test_pixel(image, lw, p, thr, lx+idx_x(i), ly+idx_y(i));
 
                 // Test maximum and mininmum responses of first segment of ARC_LENGTH
                 // pixels
@@ -137,8 +232,8 @@ void locate_features(
                 __attribute__((opencl_unroll_hint))
                 #endif
                 for (int i = ARC_LENGTH; i < 16; i++) {
-                    sum -= test_pixel(local_image, p, thr, lx+idx_x(i-ARC_LENGTH), ly+idx_y(i-ARC_LENGTH));
-                    sum += test_pixel(local_image, p, thr, lx+idx_x(i), ly+idx_y(i));
+                    sum -= test_pixel(image, lw, p, thr, lx+idx_x(i-ARC_LENGTH), ly+idx_y(i-ARC_LENGTH));
+                    sum += test_pixel(image, lw, p, thr, lx+idx_x(i), ly+idx_y(i));
                     max_sum = max(max_sum, sum);
                     min_sum = min(min_sum, sum);
                 }
@@ -149,8 +244,8 @@ void locate_features(
                 __attribute__((opencl_unroll_hint))
                 #endif
                 for (int i = 0; i < ARC_LENGTH-1; i++) {
-                    sum -= test_pixel(local_image, p, thr, lx+idx_x(16-ARC_LENGTH+i), ly+idx_y(16-ARC_LENGTH+i));
-                    sum += test_pixel(local_image, p, thr, lx+idx_x(i), ly+idx_y(i));
+                    sum -= test_pixel(image, lw, p, thr, lx+idx_x(16-ARC_LENGTH+i), ly+idx_y(16-ARC_LENGTH+i));
+                    sum += test_pixel(image, lw, p, thr, lx+idx_x(i), ly+idx_y(i));
                     max_sum = max(max_sum, sum);
                     min_sum = min(min_sum, sum);
                 }
@@ -166,42 +261,110 @@ void locate_features(
                     __attribute__((opencl_unroll_hint))
                     #endif
                     for (int i = 0; i < 16; i++) {
-                        int p_x    = local_image[lx+idx(idx_x(i), ly+idx_y(i))];
+                        int p_x    = image[lx+idx(lw, idx_x(i), ly+idx_y(i))];
                         int weight = abs((int)p_x - (int)p) - thr;
                         s_bright += test_greater(p_x, p, thr) * weight;
                         s_dark   += test_smaller(p_x, p, thr) * weight;
                     }
 
-                    //score[x + d0 * y] = MAX_VAL(s_bright, s_dark);
-                    local_score[idx(lx, ly)] = MAX_VAL(s_bright, s_dark);
+                    local_score[idx(lw, lx, ii + 2)] = MAX_VAL(s_bright, s_dark);
                 }
             }
         }
 
-        for (int ii = 0; ii < NONMAX_LINES; ii++) {
-            for (int j = EDGE; j < d0 - EDGE; j++) {
+        // Rows i-1 .. i+LOCAL_LINES-2 now have their neighbours scored
+        for (int ii = 1; ii <= LOCAL_LINES; ii++) {
+            int y = i - 2 + ii;
+            if (y < EDGE || y >= d1 - EDGE)
+                continue;
+
+            for (int j = max(EDGE, x0); j < min(d0 - EDGE, x0 + stripe); j++) {
                 int x = j;
-                int y = i + ii;
-                int lx = x;
-                int ly = ii + 3;
+                int lx = x - lx0;
+                int ly = ii;
 
-                int v = local_score[idx(lx, ly)];
+                int v = local_score[idx(lw, lx, ly)];
 
                 if (v != 0) {
-                    int max_v = local_score[idx(lx-1, ly-1)];
-                    max_v = MAX_VAL(max_v, local_score[idx(lx-1, ly)]);
-                    max_v = MAX_VAL(max_v, local_score[idx(lx-1, ly+1)]);
-                    max_v = MAX_VAL(max_v, local_score[idx(lx,   ly-1)]);
-                    max_v = MAX_VAL(max_v, local_score[idx(lx,   ly+1)]);
-                    max_v = MAX_VAL(max_v, local_score[idx(lx+1, ly+1)]);
-                    max_v = MAX_VAL(max_v, local_score[idx(lx+1, ly)]);
-                    max_v = MAX_VAL(max_v, local_score[idx(lx+1, ly-1)]);
+                    int max_v = local_score[idx(lw, lx-1, ly-1)];
+                    max_v = MAX_VAL(max_v, local_score[idx(lw, lx-1, ly)]);
+                    max_v = MAX_VAL(max_v, local_score[idx(lw, lx-1, ly+1)]);
+                    max_v = MAX_VAL(max_v, local_score[idx(lw, lx,   ly-1)]);
+                    max_v = MAX_VAL(max_v, local_score[idx(lw, lx,   ly+1)]);
+                    max_v = MAX_VAL(max_v, local_score[idx(lw, lx+1, ly+1)]);
+                    max_v = MAX_VAL(max_v, local_score[idx(lw, lx+1, ly)]);
+                    max_v = MAX_VAL(max_v, local_score[idx(lw, lx+1, ly-1)]);
                     if (v > max_v)
-                        score[idx(x, y)] = v;
+                        append_feature(features, count, max_features, x, y, v);
                 }
             }
         }
+
+        // The circle rows around the step boundary are shared with the next
+        // step
+        for (int j = 0; j < EDGE*2 * lw; j++) {
+            next[j] = image[LOCAL_LINES * lw + j];
+        }
+        if (rows > 0 && !rgb)
+            wait_group_events(1, &ev);
+        cur = 1 - cur;
     }
+}
+
+__kernel __attribute__ ((reqd_work_group_size(FAST_THREADS_X, FAST_THREADS_Y, 1)))
+void locate_features(
+    __global PIXEL_TYPE *in,
+    const int d0,
+    const int d1,
+    const int x0,
+    const int stripe,
+    __global int *features,
+    __global unsigned *count,
+    const unsigned max_features,
+    const int thr,
+    const unsigned edge)
+{
+#ifdef __xilinx__
+    __attribute__((xcl_pipeline_workitems)) {
+#endif
+    // Two line buffers: the rows the next step adds are fetched into one
+    // while the other is processed, the rows both steps share are copied
+    // over locally instead of being read again
+    __local PIXEL_TYPE local_image[2 * IMAGE_LINES * WIDTH];
+    __local int local_score[SCORE_LINES * WIDTH];
+
+    find_features(in, 0, d0, d1, x0, stripe, features, count, max_features, thr,
+                  local_image, local_score);
+#ifdef __xilinx__
+    }
+#endif
+}
+
+// locate_features_rgb()
+// Same as locate_features() for packed 32-bit color frames, as QImage stores
+// them. Rows are converted to gray while they are loaded, so the host uploads
+// the frame as it is and never converts it.
+__kernel __attribute__ ((reqd_work_group_size(FAST_THREADS_X, FAST_THREADS_Y, 1)))
+void locate_features_rgb(
+    __global const uint *in,
+    const int d0,
+    const int d1,
+    const int x0,
+    const int stripe,
+    __global int *features,
+    __global unsigned *count,
+    const unsigned max_features,
+    const int thr,
+    const unsigned edge)
+{
+#ifdef __xilinx__
+    __attribute__((xcl_pipeline_workitems)) {
+#endif
+    __local PIXEL_TYPE local_image[2 * IMAGE_LINES * WIDTH];
+    __local int local_score[SCORE_LINES * WIDTH];
+
+    find_features(0, in, d0, d1, x0, stripe, features, count, max_features, thr,
+                  local_image, local_score);
 #ifdef __xilinx__
     }
 #endif
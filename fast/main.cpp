@@ -8,9 +8,11 @@
 #include <ctime>
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include "oclHelper.h"
+#include "fastCpu.h"
 #include "pgm.h"
 
 const int FAST_THREADS_X = 1;
@@ -18,6 +20,30 @@ const int FAST_THREADS_Y = 1;
 const int FAST_THREADS_NONMAX_X = 32;
 const int FAST_THREADS_NONMAX_Y = 8;
 
+// Work group of locate_features in fast.cl, and the block of pixels each
+// group of its non-maximal suppression kernels covers
+const int NDRANGE_THREADS_X = 16;
+const int NDRANGE_THREADS_Y = 16;
+const int NONMAX_BLOCK_X = FAST_THREADS_NONMAX_X * 2;
+const int NONMAX_BLOCK_Y = FAST_THREADS_NONMAX_Y * 8;
+
+// Widest stripe, halo included, the prebuilt pipeline binaries process at
+// once and the widest one kernels built from source are specialized for
+const int KERNEL_WIDTH = 640;
+const int SOURCE_WIDTH = 1024;
+
+// Local memory the pipeline kernels take per column and pixel byte, for
+// the larger of the two: the two image buffers of LOCAL_LINES + 6 rows of
+// fast_pipeline_nonmax.cl, plus its LOCAL_LINES + 2 rows of int scores
+const int LOCAL_IMAGE_ROWS = 2 * (17 + 6);
+const int LOCAL_SCORE_BYTES = (17 + 2) * sizeof(int);
+
+// Left to the kernels' other local variables
+const int LOCAL_RESERVE = 1024;
+
+// Columns the kernels read on each side of a stripe
+const int STRIPE_HALO = 4;
+
 class Timer {
     time_t mTimeStart;
     time_t mTimeEnd;
@@ -38,11 +64,36 @@ public:
 
 typedef std::pair<int, int> Position;
 
+// ndrange runs fast.cl with one work item per pixel, task runs the single
+// work item pipeline kernels. By default accelerators use task.
+enum LaunchMode {
+    MODE_AUTO,
+    MODE_NDRANGE,
+    MODE_TASK
+};
+
+struct Feature {
+    int mX;
+    int mY;
+    int mScore;
+};
+
+static bool rasterOrder(const Feature& a, const Feature& b)
+{
+    return (a.mY != b.mY) ? (a.mY < b.mY) : (a.mX < b.mX);
+}
+
 const static struct option long_options[] = {
     {"device",        required_argument, 0, 'd'},
+    {"events",        no_argument,       0, 'e'},
     {"kernel",        required_argument, 0, 'k'},
     {"img_file",      required_argument, 0, 'f'},
     {"iteration",     optional_argument, 0, 'i'},
+    {"threads",       required_argument, 0, 'j'},
+    {"mode",          required_argument, 0, 'm'},
+    {"pixel",         required_argument, 0, 'p'},
+    {"pinned",        no_argument,       0, 'z'},
+    {"strength",      no_argument,       0, 's'},
     {"verbose",       no_argument,       0, 'v'},
     {"help",          no_argument,       0, 'h'},
     {0, 0, 0, 0}
@@ -51,12 +102,18 @@ const static struct option long_options[] = {
 static void printHelp()
 {
     std::cout << "usage: %s <options>\n";
-    std::cout << "  -d <cpu|gpu|acc>\n";
+    std::cout << "  -d <cpu|gpu|acc|host>\n";
+    std::cout << "  -e\n";
     std::cout << "  -k <kernel_file> \n";
     std::cout << "  -f <img_file>\n";
     std::cout << "  -i <iteration_count>\n";
+    std::cout << "  -j <host_threads>\n";
+    std::cout << "  -m <ndrange|task>\n";
+    std::cout << "  -p <uchar|int>\n";
+    std::cout << "  -s\n";
     std::cout << "  -t <fast_thr>\n";
     std::cout << "  -v\n";
+    std::cout << "  -z\n";
     std::cout << "  -h\n";
 }
 
@@ -95,10 +152,36 @@ int runTest(std::string imgFile, std::vector<int> fpgaX, std::vector<int> fpgaY,
     return 0;
 }
 
+// Pixels of a strength map that pass the segment test with fast_thr
+static size_t strengthCount(const std::vector<int>& strength, int fast_thr)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < strength.size(); i++)
+        count += (strength[i] >= fast_thr && strength[i] > 0);
+    return count;
+}
+
+// Where the next command of a stage stores its event, null when not
+// profiling
+static cl_event* stageEvent(std::vector<cl_event>& stage, bool profile)
+{
+    if (!profile)
+        return 0;
+    stage.push_back(0);
+    return &stage.back();
+}
+
+static void printEventTimes(const char* stage, const oclEventTimes& times, int count)
+{
+    std::cout << stage << times.mQueuedMs / count << " / " << times.mSubmitMs / count << " / "
+              << times.mRunMs / count << " ms\n";
+}
+
 static int runOpenCL(std::string imgFile, std::string kernelFile, cl_device_type deviceType,
-                     int iteration, int fast_thr, bool verbose, double &delay)
+                     int iteration, int fast_thr, bool intPixels, bool ndrange, bool strength,
+                     bool pinned, bool profile, bool verbose, double &delay)
 {
-    oclHardware hardware = getOclHardware(deviceType);
+    oclHardware hardware = getOclHardware(deviceType, profile ? CL_QUEUE_PROFILING_ENABLE : 0);
     if (!hardware.mQueue) {
         return -1;
     }
@@ -108,47 +191,183 @@ static int runOpenCL(std::string imgFile, std::string kernelFile, cl_device_type
     std::memset(&software, 0, sizeof(oclSoftware));
     std::strcpy(software.mKernelName, "locate_features");
     std::strcpy(software.mFileName, kernelFile.c_str());
+    if (intPixels)
+        std::strcpy(software.mCompileOptions, "-DPIXEL_TYPE=int");
 
-    getOclSoftware(software, hardware);
-
-    int* h_img;
+    // 32-bit pixels only when the kernel was built for them, 8-bit images
+    // are uploaded straight from the mapped file
+    pgmImage h_img8;
+    int* h_img32 = 0;
     size_t w, h;
-    readPGM(&h_img, &w, &h, imgFile);
+    int status = intPixels ? readPGM(&h_img32, &w, &h, imgFile)
+                           : mapPGM(h_img8, imgFile);
+    if (status != PGM_SUCCESS) {
+        std::cout << "Failed to read " << imgFile << "\n";
+        return -1;
+    }
+    if (!intPixels) {
+        w = h_img8.mWidth;
+        h = h_img8.mHeight;
+    }
+
+    // Kernels built from source are specialized for the image width, wider
+    // images are processed as stripes of columns that fit the local buffers
+    const std::string ext(".cl");
+    int kernel_width = KERNEL_WIDTH;
+    if (!ndrange && kernelFile.size() > ext.size() &&
+        kernelFile.compare(kernelFile.size() - ext.size(), ext.size(), ext) == 0) {
+        // Narrower stripes on devices whose local memory is too small for
+        // SOURCE_WIDTH columns, 32 KB when the size is unknown
+        cl_ulong local = getLocalMemSize(hardware);
+        if (local == 0)
+            local = 32 << 10;
+        const cl_ulong pixel = intPixels ? sizeof(int) : sizeof(unsigned char);
+        const cl_ulong column = LOCAL_IMAGE_ROWS * pixel + LOCAL_SCORE_BYTES;
+        const cl_ulong columns = local > LOCAL_RESERVE ? (local - LOCAL_RESERVE) / column : 0;
+        kernel_width = std::min((int)w, (int)std::max<cl_ulong>(std::min<cl_ulong>(columns, SOURCE_WIDTH),
+                                                                 4 * STRIPE_HALO));
+        size_t len = std::strlen(software.mCompileOptions);
+        std::snprintf(software.mCompileOptions + len, sizeof(software.mCompileOptions) - len,
+                      "%s-DWIDTH=%d", len ? " " : "", kernel_width);
+    }
+    const int stripe = (kernel_width >= (int)w) ? (int)w : kernel_width - 2 * STRIPE_HALO;
+
+    if (getOclSoftware(software, hardware)) {
+        if (!intPixels)
+            unmapPGM(h_img8);
+        delete[] h_img32;
+        return -1;
+    }
+
+    const void* h_img = intPixels ? (const void*)h_img32 : (const void*)h_img8.mData;
+    const size_t pixel_size = intPixels ? sizeof(int) : sizeof(unsigned char);
     size_t img_el = w*h;
 
     int wi = (int)w, hi = (int)h;
 
     cl_int err = 0;
 
-    cl_mem d_img = clCreateBuffer(hardware.mContext, CL_MEM_READ_ONLY, img_el * sizeof(int), NULL, &err);
+    // With -z the image and the feature list are allocated by the runtime in
+    // page locked host memory, the image is written and the list is read
+    // through mappings instead of copies
+    const cl_mem_flags host = pinned ? CL_MEM_ALLOC_HOST_PTR : 0;
+    cl_mem d_img = clCreateBuffer(hardware.mContext, CL_MEM_READ_ONLY | host, img_el * pixel_size, NULL, &err);
+    CL_CHECK(err);
+    // fast_pipeline.cl does no suppression, every tested pixel may be a feature
+    const cl_uint max_features = (cl_uint)img_el;
+    cl_mem d_features = clCreateBuffer(hardware.mContext, CL_MEM_WRITE_ONLY | host, max_features * 3 * sizeof(int),
+                                       NULL, &err);
     CL_CHECK(err);
-    cl_mem d_score = clCreateBuffer(hardware.mContext, CL_MEM_READ_WRITE, img_el * sizeof(int), NULL, &err);
+    cl_mem d_count = clCreateBuffer(hardware.mContext, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
     CL_CHECK(err);
 
-    CL_CHECK(clEnqueueWriteBuffer(hardware.mQueue, d_img, CL_TRUE, 0,
-                                  img_el * sizeof(int), h_img, 0, 0, 0));
+    // The data parallel kernels go through a dense score map, suppressed
+    // into flags and compacted block by block
+    cl_mem d_score = 0, d_flags = 0, d_counts = 0, d_offsets = 0;
+    cl_kernel k_counts = 0, k_features = 0;
+    size_t blocks[2] = { DIVUP(w, NONMAX_BLOCK_X), DIVUP(h, NONMAX_BLOCK_Y) };
+    if (ndrange) {
+        d_score = clCreateBuffer(hardware.mContext, CL_MEM_READ_WRITE, img_el * sizeof(int), NULL, &err);
+        CL_CHECK(err);
+        d_flags = clCreateBuffer(hardware.mContext, CL_MEM_READ_WRITE, img_el * sizeof(int), NULL, &err);
+        CL_CHECK(err);
+        d_counts = clCreateBuffer(hardware.mContext, CL_MEM_READ_WRITE, blocks[0] * blocks[1] * sizeof(cl_uint), NULL, &err);
+        CL_CHECK(err);
+        d_offsets = clCreateBuffer(hardware.mContext, CL_MEM_READ_WRITE, blocks[0] * blocks[1] * sizeof(cl_uint), NULL, &err);
+        CL_CHECK(err);
+        k_counts = clCreateKernel(software.mProgram, "non_max_counts", &err);
+        CL_CHECK(err);
+        k_features = clCreateKernel(software.mProgram, "get_features", &err);
+        CL_CHECK(err);
+    }
+
+    // With -e every command gets an event, timed per stage: the image
+    // upload once, then the count reset, the kernels and the readback of
+    // every iteration
+    std::vector<cl_event> imageEvents, uploadEvents, kernelEvents, readEvents;
+    oclEventTimes imageTimes = { 0, 0, 0 };
+    oclEventTimes uploadTimes = { 0, 0, 0 };
+    oclEventTimes kernelTimes = { 0, 0, 0 };
+    oclEventTimes readTimes = { 0, 0, 0 };
+
+    if (pinned) {
+        void* mapped = clEnqueueMapBuffer(hardware.mQueue, d_img, CL_TRUE, CL_MAP_WRITE, 0,
+                                          img_el * pixel_size, 0, 0, 0, &err);
+        CL_CHECK(err);
+        std::memcpy(mapped, h_img, img_el * pixel_size);
+        CL_CHECK(clEnqueueUnmapMemObject(hardware.mQueue, d_img, mapped, 0, 0,
+                                         stageEvent(imageEvents, profile)));
+    }
+    else {
+        CL_CHECK(clEnqueueWriteBuffer(hardware.mQueue, d_img, CL_TRUE, 0,
+                                      img_el * pixel_size, h_img, 0, 0, stageEvent(imageEvents, profile)));
+    }
 
     int arg = 0;
 
     const unsigned edge = 3;
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_mem), &d_img));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &wi));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &hi));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_mem), &d_score));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &fast_thr));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(unsigned), &edge));
-
+    const int stripe_arg = 3;
     size_t localSize[2] = { FAST_THREADS_X, FAST_THREADS_Y };
-
     size_t globalSize[2] = { 1, 1 };
+    size_t nonmaxLocal[2] = { FAST_THREADS_NONMAX_X, FAST_THREADS_NONMAX_Y };
+    size_t nonmaxGlobal[2] = { blocks[0] * FAST_THREADS_NONMAX_X, blocks[1] * FAST_THREADS_NONMAX_Y };
+
+    if (ndrange) {
+        // One work item per tested pixel, each group loads its tile plus a
+        // 3 pixel border into local memory
+        localSize[0] = NDRANGE_THREADS_X;
+        localSize[1] = NDRANGE_THREADS_Y;
+        globalSize[0] = DIVUP(std::max(wi - 2 * (int)edge, 1), NDRANGE_THREADS_X) * NDRANGE_THREADS_X;
+        globalSize[1] = DIVUP(std::max(hi - 2 * (int)edge, 1), NDRANGE_THREADS_Y) * NDRANGE_THREADS_Y;
+        const size_t tile = (NDRANGE_THREADS_X + 6) * (NDRANGE_THREADS_Y + 6) * pixel_size;
+
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_mem), &d_img));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &wi));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &hi));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_mem), &d_score));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &fast_thr));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(unsigned), &edge));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, tile, NULL));
+
+        arg = 0;
+        CL_CHECK(clSetKernelArg(k_counts, arg++, sizeof(cl_mem), &d_counts));
+        CL_CHECK(clSetKernelArg(k_counts, arg++, sizeof(cl_mem), &d_offsets));
+        CL_CHECK(clSetKernelArg(k_counts, arg++, sizeof(cl_mem), &d_count));
+        CL_CHECK(clSetKernelArg(k_counts, arg++, sizeof(cl_mem), &d_flags));
+        CL_CHECK(clSetKernelArg(k_counts, arg++, sizeof(cl_mem), &d_score));
+        CL_CHECK(clSetKernelArg(k_counts, arg++, sizeof(int), &wi));
+        CL_CHECK(clSetKernelArg(k_counts, arg++, sizeof(int), &hi));
+        CL_CHECK(clSetKernelArg(k_counts, arg++, sizeof(unsigned), &edge));
+
+        arg = 0;
+        CL_CHECK(clSetKernelArg(k_features, arg++, sizeof(cl_mem), &d_features));
+        CL_CHECK(clSetKernelArg(k_features, arg++, sizeof(cl_mem), &d_flags));
+        CL_CHECK(clSetKernelArg(k_features, arg++, sizeof(cl_mem), &d_counts));
+        CL_CHECK(clSetKernelArg(k_features, arg++, sizeof(cl_mem), &d_offsets));
+        CL_CHECK(clSetKernelArg(k_features, arg++, sizeof(int), &wi));
+        CL_CHECK(clSetKernelArg(k_features, arg++, sizeof(int), &hi));
+        CL_CHECK(clSetKernelArg(k_features, arg++, sizeof(cl_uint), &max_features));
+        CL_CHECK(clSetKernelArg(k_features, arg++, sizeof(unsigned), &edge));
+    }
+    else {
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_mem), &d_img));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &wi));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &hi));
+        arg += 2;
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_mem), &d_features));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_mem), &d_count));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_uint), &max_features));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &fast_thr));
+        CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(unsigned), &edge));
+    }
 
     if (verbose) {
         std::cout << "Global size = (" << globalSize[0] << "," << globalSize[1] << ",1)" << std::endl;
         std::cout << "Local  size = (" << localSize[0] << "," << localSize[1] << ",1)" << std::endl;
     }
 
-    std::vector<int> h_score_init(w * h, 0);
-    int* h_score = new int[img_el];
+    std::vector<int> h_features;
+    std::vector<Feature> features;
 
     std::vector<int> x, y, score;
 
@@ -156,46 +375,210 @@ static int runOpenCL(std::string imgFile, std::string kernelFile, cl_device_type
     for(int i = 0; i < iteration; i++)
     {
         // Here we start measurings host time for kernel execution
-        CL_CHECK(clEnqueueWriteBuffer(hardware.mQueue, d_score, CL_TRUE, 0,
-                                      img_el * sizeof(int), &h_score_init[0], 0, 0, 0));
+        const cl_uint zero = 0;
+        CL_CHECK(clEnqueueWriteBuffer(hardware.mQueue, d_count, CL_FALSE, 0,
+                                      sizeof(cl_uint), &zero, 0, 0, stageEvent(uploadEvents, profile)));
+
+        // locate_features() writes every tested score, the map is not
+        // cleared between iterations
+        if (ndrange) {
+            CL_CHECK(clEnqueueNDRangeKernel(hardware.mQueue, software.mKernel, 2, 0,
+                                            globalSize, localSize, 0, 0, stageEvent(kernelEvents, profile)));
+            CL_CHECK(clEnqueueNDRangeKernel(hardware.mQueue, k_counts, 2, 0,
+                                            nonmaxGlobal, nonmaxLocal, 0, 0, stageEvent(kernelEvents, profile)));
+            CL_CHECK(clEnqueueNDRangeKernel(hardware.mQueue, k_features, 2, 0,
+                                            nonmaxGlobal, nonmaxLocal, 0, 0, stageEvent(kernelEvents, profile)));
+        }
+        else {
+            for (int x0 = 0; x0 < wi; x0 += stripe) {
+                CL_CHECK(clSetKernelArg(software.mKernel, stripe_arg, sizeof(int), &x0));
+                CL_CHECK(clSetKernelArg(software.mKernel, stripe_arg + 1, sizeof(int), &stripe));
+                CL_CHECK(clEnqueueNDRangeKernel(hardware.mQueue, software.mKernel, 2, 0,
+                                                globalSize, localSize, 0, 0, stageEvent(kernelEvents, profile)));
+            }
+        }
 
-        CL_CHECK(clEnqueueNDRangeKernel(hardware.mQueue, software.mKernel, 2, 0,
-                                        globalSize, localSize, 0, 0, 0));
+        // Only the count and the used part of the list are read back
+        cl_uint count = 0;
+        CL_CHECK(clEnqueueReadBuffer(hardware.mQueue, d_count, CL_TRUE, 0,
+                                     sizeof(cl_uint), &count, 0, 0, stageEvent(readEvents, profile)));
+        count = std::min(count, max_features);
+
+        const int* found = 0;
+        if (count > 0 && pinned) {
+            found = (const int*)clEnqueueMapBuffer(hardware.mQueue, d_features, CL_TRUE, CL_MAP_READ, 0,
+                                                   count * 3 * sizeof(int), 0, 0,
+                                                   stageEvent(readEvents, profile), &err);
+            CL_CHECK(err);
+        }
+        else if (count > 0) {
+            h_features.resize(count * 3);
+            CL_CHECK(clEnqueueReadBuffer(hardware.mQueue, d_features, CL_TRUE, 0,
+                                         count * 3 * sizeof(int), &h_features[0], 0, 0,
+                                         stageEvent(readEvents, profile)));
+            found = &h_features[0];
+        }
 
-        CL_CHECK(clFinish(hardware.mQueue));
-
-        CL_CHECK(clEnqueueReadBuffer(hardware.mQueue, d_score, CL_TRUE, 0,
-                                     img_el * sizeof(int), h_score, 0, 0, 0));
-
-        if (i == iteration-1) {
-            for (size_t j = 0; j < h; j++) {
-                for (size_t k = 0; k < w; k++) {
-                    size_t idx = j*w + k;
-                    int s = h_score[idx];
-                    if (s != 0) {
-                        x.push_back(k);
-                        y.push_back(j);
-                        score.push_back(s);
-
-                        if (verbose)
-                            std::cout << "(" << k << ", " << j << "): " << s << std::endl;
-                    }
-                }
+        if (i == iteration - 1) {
+            features.resize(count);
+            for (size_t j = 0; j < count; j++) {
+                features[j].mX = found[3*j + 0];
+                features[j].mY = found[3*j + 1];
+                features[j].mScore = found[3*j + 2];
+            }
+        }
+
+        if (count > 0 && pinned) {
+            CL_CHECK(clEnqueueUnmapMemObject(hardware.mQueue, d_features, (void*)found, 0, 0,
+                                             stageEvent(readEvents, profile)));
+        }
+
+        if (profile) {
+            CL_CHECK(clFinish(hardware.mQueue));
+            if (addEventTimes(imageTimes, imageEvents) || addEventTimes(uploadTimes, uploadEvents) ||
+                addEventTimes(kernelTimes, kernelEvents) || addEventTimes(readTimes, readEvents)) {
+                std::cout << "No profiling information, events are not timed\n";
+                profile = false;
             }
         }
     }
     delay = timer.stop();
 
+    if (profile) {
+        // Each stage spans its first command queued to its last one done
+        std::cout << "Device time, queued / submitted / running:\n";
+        printEventTimes("  Image upload: ", imageTimes, 1);
+        printEventTimes("  Count reset per iteration: ", uploadTimes, iteration);
+        printEventTimes("  Kernels per iteration: ", kernelTimes, iteration);
+        printEventTimes("  Readback per iteration: ", readTimes, iteration);
+        const double transfers = imageTimes.mRunMs + uploadTimes.mRunMs + readTimes.mRunMs;
+        std::cout << (transfers > kernelTimes.mRunMs ? "Transfer" : "Kernel") << " bound, "
+                  << transfers << " ms of transfers and " << kernelTimes.mRunMs << " ms of kernels\n";
+    }
+
+    // The list is in the order the kernel found the features, test files
+    // are in raster order
+    std::sort(features.begin(), features.end(), rasterOrder);
+
+    for (size_t i = 0; i < features.size(); i++) {
+        x.push_back(features[i].mX);
+        y.push_back(features[i].mY);
+        score.push_back(features[i].mScore);
+
+        if (verbose)
+            std::cout << "(" << features[i].mX << ", " << features[i].mY << "): " << features[i].mScore << std::endl;
+    }
+
     int testRes = runTest(imgFile, x, y, score);
 
-    delete[] h_img;
-    delete[] h_score;
+    // The strength map of fast.cl is checked against the host one
+    if (ndrange && strength) {
+        cl_kernel k_strength = clCreateKernel(software.mProgram, "strength_map", &err);
+        CL_CHECK(err);
+        const size_t tile = (NDRANGE_THREADS_X + 6) * (NDRANGE_THREADS_Y + 6) * pixel_size;
+        arg = 0;
+        CL_CHECK(clSetKernelArg(k_strength, arg++, sizeof(cl_mem), &d_img));
+        CL_CHECK(clSetKernelArg(k_strength, arg++, sizeof(int), &wi));
+        CL_CHECK(clSetKernelArg(k_strength, arg++, sizeof(int), &hi));
+        CL_CHECK(clSetKernelArg(k_strength, arg++, sizeof(cl_mem), &d_flags));
+        CL_CHECK(clSetKernelArg(k_strength, arg++, sizeof(unsigned), &edge));
+        CL_CHECK(clSetKernelArg(k_strength, arg++, tile, NULL));
+
+        // The border is not tested, it is cleared on the device to compare
+        // the whole map
+        std::vector<int> h_strength(img_el);
+        const int zero = 0;
+        CL_CHECK(clEnqueueFillBuffer(hardware.mQueue, d_flags, &zero, sizeof(int), 0,
+                                     img_el * sizeof(int), 0, 0, 0));
+        CL_CHECK(clEnqueueNDRangeKernel(hardware.mQueue, k_strength, 2, 0,
+                                        globalSize, localSize, 0, 0, 0));
+        CL_CHECK(clEnqueueReadBuffer(hardware.mQueue, d_flags, CL_TRUE, 0,
+                                     img_el * sizeof(int), &h_strength[0], 0, 0, 0));
+        clReleaseKernel(k_strength);
+
+        std::vector<int> gold;
+        if (intPixels)
+            fastCpuStrength(gold, h_img32, wi, hi);
+        else
+            fastCpuStrength(gold, h_img8.mData, wi, hi);
+        if (h_strength != gold)
+            testRes = 1;
+        std::cout << "Strength map: " << strengthCount(h_strength, fast_thr)
+                  << " pixels pass the segment test with threshold " << fast_thr << std::endl;
+    }
+
+    if (!intPixels)
+        unmapPGM(h_img8);
+    delete[] h_img32;
     clReleaseMemObject(d_img);
-    clReleaseMemObject(d_score);
+    clReleaseMemObject(d_features);
+    clReleaseMemObject(d_count);
+    if (ndrange) {
+        clReleaseKernel(k_counts);
+        clReleaseKernel(k_features);
+        clReleaseMemObject(d_score);
+        clReleaseMemObject(d_flags);
+        clReleaseMemObject(d_counts);
+        clReleaseMemObject(d_offsets);
+    }
 
     return testRes;
 }
 
+static int runHost(std::string imgFile, int iteration, int fast_thr, unsigned nthreads,
+                   bool intPixels, bool strength, bool verbose, double &delay)
+{
+    pgmImage h_img8;
+    int* h_img32 = 0;
+    size_t w, h;
+    int status = intPixels ? readPGM(&h_img32, &w, &h, imgFile)
+                           : mapPGM(h_img8, imgFile);
+    if (status != PGM_SUCCESS) {
+        std::cout << "Failed to read " << imgFile << "\n";
+        return -1;
+    }
+    if (!intPixels) {
+        w = h_img8.mWidth;
+        h = h_img8.mHeight;
+    }
+
+    if (verbose)
+        std::cout << "Host segment test: " << (intPixels ? "scalar, 32-bit" : fastCpuSimdName(fastCpuSimd())) << std::endl;
+
+    std::vector<int> x, y, score;
+
+    int err = 0;
+    Timer timer;
+    for(int i = 0; i < iteration && !err; i++)
+    {
+        err = intPixels ? fastCpu(x, y, score, h_img32, (int)w, (int)h, fast_thr, nthreads)
+                        : fastCpu(x, y, score, h_img8.mData, (int)w, (int)h, fast_thr, nthreads);
+    }
+    delay = timer.stop();
+
+    if (verbose) {
+        for (size_t i = 0; i < x.size(); i++)
+            std::cout << "(" << x[i] << ", " << y[i] << "): " << score[i] << std::endl;
+    }
+
+    int testRes = err ? err : runTest(imgFile, x, y, score);
+
+    if (strength && !testRes) {
+        std::vector<int> map;
+        if (intPixels)
+            fastCpuStrength(map, h_img32, (int)w, (int)h, nthreads);
+        else
+            fastCpuStrength(map, h_img8.mData, (int)w, (int)h, nthreads);
+        std::cout << "Strength map: " << strengthCount(map, fast_thr)
+                  << " pixels pass the segment test with threshold " << fast_thr << std::endl;
+    }
+
+    if (!intPixels)
+        unmapPGM(h_img8);
+    delete[] h_img32;
+
+    return testRes;
+}
 
 int main(int argc, char** argv)
 {
@@ -205,10 +588,17 @@ int main(int argc, char** argv)
     std::string imgFile("./data/square.pgm");
     int iteration = 1;
     int fast_thr = 20;
+    unsigned nthreads = 0;
+    bool useHost = false;
+    bool intPixels = false;
+    bool strength = false;
+    bool pinned = false;
+    bool profile = false;
+    LaunchMode mode = MODE_AUTO;
     bool verbose = false;
     // Commandline
     int c;
-    while ((c = getopt_long(argc, argv, "d:k:f:i:t:vh", long_options, &option_index)) != -1)
+    while ((c = getopt_long(argc, argv, "d:ek:f:i:j:m:p:st:vzh", long_options, &option_index)) != -1)
     {
         switch (c)
         {
@@ -222,12 +612,17 @@ int main(int argc, char** argv)
                 deviceType = CL_DEVICE_TYPE_CPU;
             else if (strcmp(optarg, "soft") == 0)
                 deviceType = CL_DEVICE_TYPE_DEFAULT;
+            else if (strcmp(optarg, "host") == 0)
+                useHost = true;
             else if (strcmp(optarg, "acc") != 0) {
                 std::cout << "Incorrect platform specified\n";
                 printHelp();
                 return -1;
             }
             break;
+        case 'e':
+            profile = true;
+            break;
         case 'k':
             kernelFile = optarg;
             break;
@@ -237,6 +632,32 @@ int main(int argc, char** argv)
         case 'i':
             iteration = atoi(optarg);
             break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "ndrange") == 0)
+                mode = MODE_NDRANGE;
+            else if (strcmp(optarg, "task") == 0)
+                mode = MODE_TASK;
+            else {
+                std::cout << "Incorrect launch mode specified\n";
+                printHelp();
+                return -1;
+            }
+            break;
+        case 'p':
+            if (strcmp(optarg, "int") == 0)
+                intPixels = true;
+            else if (strcmp(optarg, "uchar") != 0) {
+                std::cout << "Incorrect pixel type specified\n";
+                printHelp();
+                return -1;
+            }
+            break;
+        case 's':
+            strength = true;
+            break;
         case 't':
             fast_thr = atoi(optarg);
             break;
@@ -246,6 +667,9 @@ int main(int argc, char** argv)
         case 'v':
             verbose = true;
             break;
+        case 'z':
+            pinned = true;
+            break;
         default:
             printHelp();
             return 1;
@@ -253,8 +677,31 @@ int main(int argc, char** argv)
     }
 
     double delay = 0;
+    if (useHost) {
+        if (runHost(imgFile, iteration, fast_thr, nthreads, intPixels, strength, verbose, delay)) {
+            std::cout << "FAILED TEST\n";
+            return 1;
+        }
+        std::cout << "Host total time: " << delay << " sec\n";
+        std::cout << "Host average time per iteration: " << delay/iteration << " sec\n";
+        std::cout << "PASSED TEST\n";
+        return 0;
+    }
+
+    // Data parallel launches unless running the single work item pipeline
+    // kernels on an accelerator
+    bool ndrange = (mode == MODE_AUTO) ? (deviceType != CL_DEVICE_TYPE_ACCELERATOR) : (mode == MODE_NDRANGE);
+
+    // strength_map is only in fast.cl
+    if (strength && !ndrange && deviceType != CL_DEVICE_TYPE_DEFAULT) {
+        std::cout << "-s needs the data parallel kernels, use -m ndrange -k fast.cl or -d host\n";
+        printHelp();
+        return 1;
+    }
+
     if ((deviceType != CL_DEVICE_TYPE_DEFAULT) && runOpenCL(imgFile, kernelFile, deviceType,
-                                                            iteration, fast_thr, verbose, delay)) {
+                                                            iteration, fast_thr, intPixels, ndrange,
+                                                            strength, pinned, profile, verbose, delay)) {
         std::cout << "FAILED TEST\n";
         std::cout << "OpenCL total time: " << delay << " sec\n";
         std::cout << "OpenCL average time per iteration: " << delay/iteration << " sec\n";
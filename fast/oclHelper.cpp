@@ -2,10 +2,18 @@
 // All rights reserved.
 
 #include "oclHelper.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static int loadFile2Memory(const char *filename, char **result)
 {
@@ -105,7 +113,170 @@ static int compileProgram(const oclHardware &hardware, oclSoftware &software)
 }
 
 
-oclHardware getOclHardware(cl_device_type type)
+// Program binaries built from source are cached on disk, keyed by everything
+// that can change the result of the build. A stale or unusable entry is
+// simply rebuilt from source and overwritten.
+static const char cacheMagic[8] = { 'O', 'C', 'L', 'B', 'I', 'N', '0', '1' };
+
+static unsigned long long fnv1a(unsigned long long hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static unsigned long long hashInfo(unsigned long long hash, cl_device_id device, cl_device_info param)
+{
+    char info[1024] = { 0 };
+    clGetDeviceInfo(device, param, sizeof(info) - 1, info, 0);
+    return fnv1a(hash, info, std::strlen(info) + 1);
+}
+
+static unsigned long long cacheKey(const oclHardware &hardware, const oclSoftware &soft,
+                                   const char *source, size_t size)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = fnv1a(hash, source, size);
+    hash = fnv1a(hash, soft.mCompileOptions, std::strlen(soft.mCompileOptions) + 1);
+    hash = fnv1a(hash, soft.mKernelName, std::strlen(soft.mKernelName) + 1);
+
+    char platform[1024] = { 0 };
+    clGetPlatformInfo(hardware.mPlatform, CL_PLATFORM_NAME, sizeof(platform) - 1, platform, 0);
+    hash = fnv1a(hash, platform, std::strlen(platform) + 1);
+    std::memset(platform, 0, sizeof(platform));
+    clGetPlatformInfo(hardware.mPlatform, CL_PLATFORM_VERSION, sizeof(platform) - 1, platform, 0);
+    hash = fnv1a(hash, platform, std::strlen(platform) + 1);
+
+    hash = hashInfo(hash, hardware.mDevice, CL_DEVICE_NAME);
+    hash = hashInfo(hash, hardware.mDevice, CL_DEVICE_VERSION);
+    hash = hashInfo(hash, hardware.mDevice, CL_DRIVER_VERSION);
+    return hash;
+}
+
+static std::string cacheDir(const oclSoftware &soft)
+{
+    if (soft.mCacheDir[0])
+        return soft.mCacheDir;
+
+    const char *dir = std::getenv("OCL_CACHE_DIR");
+    if (dir)
+        return dir;
+
+    const char *home = std::getenv("HOME");
+    if (!home || !home[0])
+        return "";
+    return std::string(home) + "/.cache/xilinx_demos";
+}
+
+static bool makeDirs(const std::string &path)
+{
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i < path.size() && path[i] != '/')
+            continue;
+        std::string part = path.substr(0, i);
+        if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+static std::string cacheFile(const std::string &dir, unsigned long long key)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.bin", key);
+    return dir + name;
+}
+
+static bool loadCachedBinary(const std::string &file, unsigned long long key, std::vector<unsigned char> &binary)
+{
+    std::ifstream stream(file.c_str(), std::ifstream::binary);
+    if (!stream)
+        return false;
+
+    char magic[sizeof(cacheMagic)];
+    unsigned long long storedKey = 0;
+    stream.read(magic, sizeof(magic));
+    stream.read((char *)&storedKey, sizeof(storedKey));
+    if (!stream || std::memcmp(magic, cacheMagic, sizeof(magic)) != 0 || storedKey != key)
+        return false;
+
+    std::ostringstream rest;
+    rest << stream.rdbuf();
+    std::string data = rest.str();
+    if (data.empty())
+        return false;
+    binary.assign(data.begin(), data.end());
+    return true;
+}
+
+static void storeCachedBinary(const std::string &dir, const std::string &file, unsigned long long key,
+                              const oclSoftware &soft)
+{
+    size_t size = 0;
+    if (clGetProgramInfo(soft.mProgram, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, 0) != CL_SUCCESS || size == 0)
+        return;
+
+    std::vector<unsigned char> binary(size);
+    unsigned char *binaries[1] = { &binary[0] };
+    if (clGetProgramInfo(soft.mProgram, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, 0) != CL_SUCCESS)
+        return;
+
+    if (!makeDirs(dir))
+        return;
+
+    // Written under a temporary name so concurrent processes never see a
+    // partial file
+    std::ostringstream tmp;
+    tmp << file << "." << getpid() << ".tmp";
+    {
+        std::ofstream stream(tmp.str().c_str(), std::ofstream::binary);
+        stream.write(cacheMagic, sizeof(cacheMagic));
+        stream.write((const char *)&key, sizeof(key));
+        stream.write((const char *)&binary[0], size);
+        if (!stream) {
+            stream.close();
+            std::remove(tmp.str().c_str());
+            return;
+        }
+    }
+    if (std::rename(tmp.str().c_str(), file.c_str()) != 0)
+        std::remove(tmp.str().c_str());
+}
+
+// Tries to create and build the program from a cached binary, returns 0 on
+// success
+static int loadFromCache(const oclHardware &hardware, oclSoftware &soft, const std::string &file,
+                         unsigned long long key)
+{
+    std::vector<unsigned char> binary;
+    if (!loadCachedBinary(file, key, binary))
+        return -1;
+
+    size_t n = binary.size();
+    const unsigned char *data = &binary[0];
+    cl_int status = CL_SUCCESS;
+    cl_int err = CL_SUCCESS;
+    soft.mProgram = clCreateProgramWithBinary(hardware.mContext, 1, &hardware.mDevice, &n,
+                                              &data, &status, &err);
+    if (soft.mProgram && err == CL_SUCCESS && status == CL_SUCCESS &&
+        clBuildProgram(soft.mProgram, 1, &hardware.mDevice, soft.mCompileOptions, 0, 0) == CL_SUCCESS) {
+        soft.mKernel = clCreateKernel(soft.mProgram, soft.mKernelName, NULL);
+        if (soft.mKernel)
+            return 0;
+    }
+
+    if (soft.mProgram)
+        clReleaseProgram(soft.mProgram);
+    soft.mProgram = 0;
+    std::remove(file.c_str());
+    return -1;
+}
+
+
+oclHardware getOclHardware(cl_device_type type, cl_command_queue_properties properties)
 {
     oclHardware hardware = {0, 0, 0, 0, 0, 0};
     cl_platform_id platforms[16] = { 0 };
@@ -143,7 +314,7 @@ oclHardware getOclHardware(cl_device_type type)
         if (err != CL_SUCCESS) {
             continue;
         }
-        cl_command_queue queue = clCreateCommandQueue(context, devices[0], 0, &err);
+        cl_command_queue queue = clCreateCommandQueue(context, devices[0], properties, &err);
         if (err != CL_SUCCESS) {
             std::cout << oclErrorCode(err) << "\n";
             return hardware;
@@ -161,6 +332,103 @@ oclHardware getOclHardware(cl_device_type type)
     return hardware;
 }
 
+int getOclHardware(oclHardware* hardware, int maxDevices, cl_device_type type)
+{
+    int count = 0;
+    cl_platform_id platforms[16] = { 0 };
+    cl_device_id devices[16];
+    char deviceName[256];
+    cl_uint platformCount = 0;
+    cl_int err = clGetPlatformIDs(16, platforms, &platformCount);
+    if (err != CL_SUCCESS) {
+        std::cout << oclErrorCode(err) << "\n";
+        return 0;
+    }
+
+    for (cl_uint i = 0; i < platformCount && count < maxDevices; i++) {
+        cl_uint deviceCount = 0;
+        err = clGetDeviceIDs(platforms[i], type, 16, devices, &deviceCount);
+        if ((err != CL_SUCCESS) || (deviceCount == 0)) {
+            continue;
+        }
+        if (deviceCount > 16)
+            deviceCount = 16;
+
+        // Every device gets a context of its own, so programs are built
+        // and buffers are allocated for that device only
+        for (cl_uint j = 0; j < deviceCount && count < maxDevices; j++) {
+            cl_context_properties contextData[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)platforms[i], 0};
+            cl_context context = clCreateContext(contextData, 1, &devices[j], 0, 0, &err);
+            if (err != CL_SUCCESS) {
+                continue;
+            }
+            cl_command_queue queue = clCreateCommandQueue(context, devices[j], 0, &err);
+            if (err != CL_SUCCESS) {
+                std::cout << oclErrorCode(err) << "\n";
+                clReleaseContext(context);
+                continue;
+            }
+            oclHardware& device = hardware[count++];
+            device.mPlatform = platforms[i];
+            device.mContext = context;
+            device.mDevice = devices[j];
+            device.mQueue = queue;
+            getDeviceVersion(device);
+            if (clGetDeviceInfo(devices[j], CL_DEVICE_NAME, 256, deviceName, 0) == CL_SUCCESS)
+                std::cout << "Device " << count - 1 << " = " << deviceName << "\n";
+        }
+    }
+    return count;
+}
+
+cl_ulong getLocalMemSize(const oclHardware& hardware)
+{
+    cl_ulong size = 0;
+    if (clGetDeviceInfo(hardware.mDevice, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(size), &size, 0) != CL_SUCCESS)
+        return 0;
+    return size;
+}
+
+cl_uint getComputeUnits(const oclHardware& hardware)
+{
+    cl_uint units = 0;
+    if (clGetDeviceInfo(hardware.mDevice, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, 0) != CL_SUCCESS)
+        return 0;
+    return units;
+}
+
+int addEventTimes(oclEventTimes& times, std::vector<cl_event>& events)
+{
+    cl_ulong queued = ~(cl_ulong)0, submit = ~(cl_ulong)0, start = ~(cl_ulong)0, end = 0;
+    int err = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+        if (!events[i])
+            continue;
+        cl_ulong t[4];
+        const cl_profiling_info info[4] = { CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+                                            CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END };
+        for (int j = 0; j < 4 && !err; j++) {
+            if (clGetEventProfilingInfo(events[i], info[j], sizeof(cl_ulong), &t[j], 0) != CL_SUCCESS)
+                err = -1;
+        }
+        if (!err) {
+            queued = std::min(queued, t[0]);
+            submit = std::min(submit, t[1]);
+            start = std::min(start, t[2]);
+            end = std::max(end, t[3]);
+        }
+        clReleaseEvent(events[i]);
+    }
+    events.clear();
+
+    if (err || end == 0)
+        return err;
+    times.mQueuedMs += (submit - queued) * 1e-6;
+    times.mSubmitMs += (start - submit) * 1e-6;
+    times.mRunMs += (end - start) * 1e-6;
+    return 0;
+}
+
 int getOclSoftware(oclSoftware &soft, const oclHardware &hardware)
 {
     cl_device_type deviceType = CL_DEVICE_TYPE_DEFAULT;
@@ -179,20 +447,35 @@ int getOclSoftware(oclSoftware &soft, const oclHardware &hardware)
         return -2;
     }
 
+    std::string dir, file;
+    unsigned long long key = 0;
     if (deviceType == CL_DEVICE_TYPE_ACCELERATOR) {
         size_t n = size;
         soft.mProgram = clCreateProgramWithBinary(hardware.mContext, 1, &hardware.mDevice, &n,
                                                   (const unsigned char **) &kernelCode, 0, &err);
     }
     else {
+        dir = cacheDir(soft);
+        if (!dir.empty()) {
+            key = cacheKey(hardware, soft, (const char *)kernelCode, size);
+            file = cacheFile(dir, key);
+            if (loadFromCache(hardware, soft, file, key) == 0) {
+                std::cout << "Loaded cached binary " << file << "\n";
+                delete [] kernelCode;
+                return 0;
+            }
+        }
         soft.mProgram = clCreateProgramWithSource(hardware.mContext, 1, (const char **)&kernelCode, 0, &err);
     }
     if (!soft.mProgram || (err != CL_SUCCESS)) {
         std::cout << oclErrorCode(err) << "\n";
+        delete [] kernelCode;
         return -3;
     }
 
     int status = compileProgram(hardware, soft);
+    if (status == 0 && !file.empty())
+        storeCachedBinary(dir, file, key, soft);
     delete [] kernelCode;
     return status;
 }
@@ -5,6 +5,7 @@
 #define _OCL_HELP_H_
 
 #include <CL/cl.h>
+#include <vector>
 
 #define DIVUP(A, B) (((A) + (B) - 1) / (B))
 
@@ -32,9 +33,38 @@ struct oclSoftware {
     char mKernelName[128];
     char mFileName[1024];
     char mCompileOptions[1024];
+    // Directory caching programs built from source, empty uses $OCL_CACHE_DIR
+    // or ~/.cache/xilinx_demos. Setting $OCL_CACHE_DIR to "" disables it.
+    char mCacheDir[1024];
 };
 
-oclHardware getOclHardware(cl_device_type type);
+// properties are passed to clCreateCommandQueue(), CL_QUEUE_PROFILING_ENABLE
+// lets the events of the queue be timed with addEventTimes()
+oclHardware getOclHardware(cl_device_type type, cl_command_queue_properties properties = 0);
+
+// Opens every device of the given type on every platform, up to maxDevices,
+// each with its own context and queue. Returns how many were opened.
+int getOclHardware(oclHardware* hardware, int maxDevices, cl_device_type type);
+
+// CL_DEVICE_LOCAL_MEM_SIZE of the device, 0 when it cannot be queried
+cl_ulong getLocalMemSize(const oclHardware& hardware);
+
+// CL_DEVICE_MAX_COMPUTE_UNITS of the device, 0 when it cannot be queried
+cl_uint getComputeUnits(const oclHardware& hardware);
+
+// Time a group of commands took in each stage, in milliseconds: queued
+// until submitted to the device, submitted until started, and from the
+// start of the first one to the end of the last one
+struct oclEventTimes {
+    double mQueuedMs;
+    double mSubmitMs;
+    double mRunMs;
+};
+
+// Adds the span of events, which must have completed on profiling queues,
+// to times and releases them. Null events are skipped. Returns -1 when the
+// runtime has no profiling information for them.
+int addEventTimes(oclEventTimes& times, std::vector<cl_event>& events);
 
 int getOclSoftware(oclSoftware &software, const oclHardware &hardware);
 
@@ -8,61 +8,294 @@
  ********************************************************/
 
 #include "pgm.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-int readPGM(int** img, size_t* w, size_t* h, std::string fName)
+struct pgm_header {
+    int format;         // 2 for ASCII, 5 for binary
+    int width;
+    int height;
+    int maxval;         // Unknown (0) for ASCII files until pixels are parsed
+    size_t offset;      // First byte after the header
+};
+
+static int map_file(const std::string& fName, void** base, size_t* size)
+{
+    int fd = open(fName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return PGM_IO_ERROR;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return PGM_IO_ERROR;
+    }
+
+    void* ptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return PGM_IO_ERROR;
+
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+    *base = ptr;
+    *size = st.st_size;
+    return PGM_SUCCESS;
+}
+
+// Skips whitespace and comments, which run from '#' to the end of the line
+static void skip_space(const char* data, size_t size, size_t& pos)
 {
-    std::ifstream inFile;
-    inFile.open(fName.c_str());
+    while (pos < size) {
+        if (data[pos] == '#') {
+            while (pos < size && data[pos] != '\n')
+                pos++;
+        } else if (isspace((unsigned char)data[pos])) {
+            pos++;
+        } else {
+            break;
+        }
+    }
+}
 
-    char format[256];
-    char expectedFormat[] = "P2";
-    inFile.getline(format, 256);
+// Reads a non-negative decimal number, returns false when there is none
+static bool read_number(const char* data, size_t size, size_t& pos, int& value)
+{
+    skip_space(data, size, pos);
+    if (pos >= size || data[pos] < '0' || data[pos] > '9')
+        return false;
 
-    char comments[256];
-    inFile.getline(comments, 256);
+    value = 0;
+    while (pos < size && data[pos] >= '0' && data[pos] <= '9') {
+        if (value > 100000000)
+            return false;
+        value = value * 10 + (data[pos] - '0');
+        pos++;
+    }
+    return true;
+}
 
-    if (strcmp(expectedFormat, format) != 0 ||
-        comments[0] != '#')
+static int parse_header(const char* data, size_t size, pgm_header& hdr)
+{
+    if (size < 2 || data[0] != 'P' || (data[1] != '2' && data[1] != '5'))
         return PGM_WRONG_FORMAT;
+    hdr.format = data[1] - '0';
 
-    int width, height;
-    inFile >> width >> height;
-    if (width <= 0 || height <= 0)
+    size_t pos = 2;
+    if (!read_number(data, size, pos, hdr.width) ||
+        !read_number(data, size, pos, hdr.height))
+        return PGM_WRONG_FORMAT;
+    if (hdr.width <= 0 || hdr.height <= 0)
         return PGM_WRONG_DIMENSIONS;
+    if ((size_t)hdr.width > SIZE_MAX / 2 / (size_t)hdr.height)
+        return PGM_WRONG_DIMENSIONS;
+    const size_t samples = (size_t)hdr.width * hdr.height;
 
-    *img = new int[width * height];
+    // Older ASCII files written by this tool carry no maxval, it is told
+    // apart from the first pixel by counting values
+    hdr.maxval = 0;
+    if (hdr.format == 5) {
+        if (!read_number(data, size, pos, hdr.maxval))
+            return PGM_WRONG_FORMAT;
+        if (hdr.maxval <= 0 || hdr.maxval > 65535)
+            return PGM_WRONG_DEPTH;
+        // Exactly one whitespace character separates header and pixels
+        pos++;
+        size_t bytes = samples * (hdr.maxval > 255 ? 2 : 1);
+        if (pos > size || bytes > size - pos)
+            return PGM_WRONG_DIMENSIONS;
+    } else {
+        // Every ASCII sample but the last takes a digit and a separator, so
+        // a header claiming more samples than the file can hold is rejected
+        // before anything is allocated for them
+        if (pos >= size || samples - 1 > (size - pos) / 2)
+            return PGM_WRONG_DIMENSIONS;
+    }
 
-    *w = (size_t)width;
-    *h = (size_t)height;
+    hdr.offset = pos;
+    return PGM_SUCCESS;
+}
 
-    for (size_t i = 0; i < (size_t)height; i++) {
-        for (size_t j = 0; j < (size_t)width; j++) {
-            int idx = i*width + j;
-            int p;
-            inFile >> p;
-            (*img)[idx] = p;
+template<typename T>
+static int parse_pixels(T* img, const char* data, size_t size, const pgm_header& hdr, int maxVal)
+{
+    const size_t n = (size_t)hdr.width * hdr.height;
+    const unsigned char* bytes = (const unsigned char*)data + hdr.offset;
+
+    if (hdr.format == 5) {
+        if (hdr.maxval > maxVal)
+            return PGM_WRONG_DEPTH;
+        if (hdr.maxval > 255) {
+            for (size_t i = 0; i < n; i++)
+                img[i] = (T)((bytes[2*i] << 8) | bytes[2*i + 1]);
+        } else {
+            for (size_t i = 0; i < n; i++)
+                img[i] = (T)bytes[i];
         }
+        return PGM_SUCCESS;
+    }
+
+    size_t pos = hdr.offset;
+    int first = 0;
+    if (!read_number(data, size, pos, first))
+        return PGM_WRONG_DIMENSIONS;
+
+    // Pixels go one slot to the right until we know whether the first
+    // value was the maxval or the first pixel
+    for (size_t i = 1; i < n; i++) {
+        int p;
+        if (!read_number(data, size, pos, p))
+            return PGM_WRONG_DIMENSIONS;
+        if (p > maxVal)
+            return PGM_WRONG_DEPTH;
+        img[i] = (T)p;
     }
 
-    inFile.close();
+    int last;
+    if (read_number(data, size, pos, last)) {
+        if (last > maxVal)
+            return PGM_WRONG_DEPTH;
+        memmove(img, img + 1, (n - 1) * sizeof(T));
+        img[n - 1] = (T)last;
+    } else {
+        if (first > maxVal)
+            return PGM_WRONG_DEPTH;
+        img[0] = (T)first;
+    }
 
     return PGM_SUCCESS;
 }
 
-void writePGM(std::string fName, int* img, size_t w, size_t h)
+template<typename T>
+static int read_pgm(T** img, size_t* w, size_t* h, std::string fName, int maxVal)
+{
+    void* base = 0;
+    size_t size = 0;
+    int status = map_file(fName, &base, &size);
+    if (status != PGM_SUCCESS)
+        return status;
+
+    const char* data = (const char*)base;
+    pgm_header hdr;
+    status = parse_header(data, size, hdr);
+    if (status == PGM_SUCCESS) {
+        *img = new T[(size_t)hdr.width * hdr.height];
+        status = parse_pixels(*img, data, size, hdr, maxVal);
+        if (status == PGM_SUCCESS) {
+            *w = (size_t)hdr.width;
+            *h = (size_t)hdr.height;
+        } else {
+            delete[] *img;
+            *img = 0;
+        }
+    }
+
+    munmap(base, size);
+    return status;
+}
+
+template<typename T>
+static void write_pgm(std::string fName, T* img, size_t w, size_t h)
 {
+    int maxval = 255;
+    for (size_t i = 0; i < w*h; i++)
+        maxval = std::max(maxval, (int)img[i]);
+
     std::ofstream outFile;
     outFile.open(fName.c_str());
     outFile << "P2" << std::endl;
     outFile << "# Simple square sample" << std::endl;
     outFile << w << " " << h << std::endl;
+    outFile << maxval << std::endl;
     for (size_t i = 0; i < h; i++) {
         for (size_t j = 0; j < w; j++) {
             size_t idx = i*w + j;
-            outFile << img[idx] << " ";
+            outFile << (int)img[idx] << " ";
         }
         outFile << std::endl;
     }
 
     outFile.close();
 }
+
+int mapPGM(pgmImage& img, std::string fName)
+{
+    std::memset(&img, 0, sizeof(pgmImage));
+
+    int status = map_file(fName, &img.mMap, &img.mMapSize);
+    if (status != PGM_SUCCESS)
+        return status;
+
+    const char* data = (const char*)img.mMap;
+    pgm_header hdr;
+    status = parse_header(data, img.mMapSize, hdr);
+    if (status != PGM_SUCCESS) {
+        unmapPGM(img);
+        return status;
+    }
+
+    img.mWidth = (size_t)hdr.width;
+    img.mHeight = (size_t)hdr.height;
+
+    // 8-bit binary pixels are used in place
+    if (hdr.format == 5 && hdr.maxval <= 255) {
+        img.mData = (const unsigned char*)data + hdr.offset;
+        return PGM_SUCCESS;
+    }
+
+    img.mOwned = new unsigned char[img.mWidth * img.mHeight];
+    status = parse_pixels(img.mOwned, data, img.mMapSize, hdr, 255);
+    munmap(img.mMap, img.mMapSize);
+    img.mMap = 0;
+    img.mMapSize = 0;
+
+    if (status != PGM_SUCCESS) {
+        unmapPGM(img);
+        return status;
+    }
+    img.mData = img.mOwned;
+    return PGM_SUCCESS;
+}
+
+void unmapPGM(pgmImage& img)
+{
+    if (img.mMap)
+        munmap(img.mMap, img.mMapSize);
+    delete[] img.mOwned;
+    std::memset(&img, 0, sizeof(pgmImage));
+}
+
+int readPGM(unsigned char** img, size_t* w, size_t* h, std::string fName)
+{
+    return read_pgm(img, w, h, fName, 255);
+}
+
+void writePGM(std::string fName, unsigned char* img, size_t w, size_t h, bool binary)
+{
+    if (!binary) {
+        write_pgm(fName, img, w, h);
+        return;
+    }
+
+    std::ofstream outFile;
+    outFile.open(fName.c_str(), std::ofstream::binary);
+    outFile << "P5\n";
+    outFile << w << " " << h << "\n";
+    outFile << "255\n";
+    outFile.write((const char*)img, w*h);
+    outFile.close();
+}
+
+int readPGM(int** img, size_t* w, size_t* h, std::string fName)
+{
+    return read_pgm(img, w, h, fName, 65535);
+}
+
+void writePGM(std::string fName, int* img, size_t w, size_t h)
+{
+    write_pgm(fName, img, w, h);
+}
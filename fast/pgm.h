@@ -19,9 +19,34 @@ enum PGM_ERR
 {
     PGM_SUCCESS,
     PGM_WRONG_FORMAT,
-    PGM_WRONG_DIMENSIONS
+    PGM_WRONG_DIMENSIONS,
+    PGM_WRONG_DEPTH,
+    PGM_IO_ERROR
 };
 
+// Image loaded by mapPGM(). For 8-bit binary (P5) files mData points
+// straight into a read-only mapping of the file, other files are parsed
+// into a buffer owned by the structure.
+struct pgmImage {
+    const unsigned char* mData;
+    size_t mWidth;
+    size_t mHeight;
+    void* mMap;
+    size_t mMapSize;
+    unsigned char* mOwned;
+};
+
+int mapPGM(pgmImage& img, std::string fName);
+
+void unmapPGM(pgmImage& img);
+
+// Reads ASCII (P2) and binary (P5) files into a new[] allocated buffer
+int readPGM(unsigned char** img, size_t* w, size_t* h, std::string fName);
+
+// Writes a binary (P5) file when binary is set, ASCII (P2) otherwise
+void writePGM(std::string fName, unsigned char* img, size_t w, size_t h, bool binary = false);
+
+// 32-bit pixels, kept for kernels built with -DPIXEL_TYPE=int
 int readPGM(int** img, size_t* w, size_t* h, std::string fName);
 
 void writePGM(std::string fName, int* img, size_t w, size_t h);
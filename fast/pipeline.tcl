@@ -14,21 +14,31 @@ add_files "main.cpp"
 add_files "oclErrorCodes.cpp"
 add_files "oclHelper.cpp"
 add_files "pgm.cpp"
+add_files "fastCpu.cpp"
+add_files "threadPool.cpp"
 
 # Header files
 add_files "oclHelper.h"
 set_property file_type "c header files" [get_files "oclHelper.h"]
 add_files "pgm.h"
 set_property file_type "c header files" [get_files "pgm.h"]
+add_files "fastCpu.h"
+set_property file_type "c header files" [get_files "fastCpu.h"]
+add_files "threadPool.h"
+set_property file_type "c header files" [get_files "threadPool.h"]
 
 # Kernel definition
 create_kernel locate_features -type clc
 add_files -kernel [get_kernels locate_features] "fast_pipeline_nonmax.cl"
+create_kernel locate_features_rgb -type clc
+add_files -kernel [get_kernels locate_features_rgb] "fast_pipeline_nonmax.cl"
 
 # Define binary containers
 create_opencl_binary fast_pipeline_nonmax
 set_property region "OCL_REGION_0" [get_opencl_binary fast_pipeline_nonmax]
 create_compute_unit -opencl_binary [get_opencl_binary fast_pipeline_nonmax] -kernel [get_kernels locate_features] -name K1
+create_compute_unit -opencl_binary [get_opencl_binary fast_pipeline_nonmax] -kernel [get_kernels locate_features_rgb] -name K2
+create_compute_unit -opencl_binary [get_opencl_binary fast_pipeline_nonmax] -kernel [get_kernels locate_features] -name K3
 
 # Compile the design for CPU based emulation
 compile_emulation -flow cpu -opencl_binary [get_opencl_binary fast_pipeline_nonmax]
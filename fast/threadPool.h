@@ -0,0 +1,56 @@
+/*******************************************************
+ * Copyright (c) 2015, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads executing parallel-for style jobs. The thread
+// calling run() takes part in the job, so a pool of size N keeps N-1 workers.
+class ThreadPool {
+    std::vector<std::thread> mWorkers;
+    std::mutex mRunMutex;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::condition_variable mDone;
+
+    const std::function<void(unsigned)>* mJob;
+    unsigned mJobTasks;
+    unsigned mJobThreads;
+    unsigned long mGeneration;
+    unsigned mFinished;
+    std::atomic<unsigned> mNextTask;
+    bool mStop;
+
+    void worker(unsigned id);
+    void drain(const std::function<void(unsigned)>& fn, unsigned ntasks);
+
+public:
+    // nthreads == 0 uses one thread per hardware thread
+    explicit ThreadPool(unsigned nthreads = 0);
+    ~ThreadPool();
+
+    unsigned size() const { return (unsigned)mWorkers.size() + 1; }
+
+    // Calls fn(0) ... fn(ntasks-1) on at most maxThreads threads (0 means
+    // the whole pool) and returns once all of them have finished. Must not
+    // be called from inside a task.
+    void run(unsigned ntasks, const std::function<void(unsigned)>& fn, unsigned maxThreads = 0);
+
+    // Process wide pool shared by the host side algorithms
+    static ThreadPool& global();
+};
+
+#endif
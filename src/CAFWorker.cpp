@@ -7,12 +7,24 @@
 #include <QStringList>
 
 #include <QDebug>
+#include <cstring>
 #include "CAFWorker.h"
+#include "threadPool.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Frames from this size on are converted by the host thread pool
+const int GRAY_PARALLEL_PIXELS = 1 << 19;
 
 CAFWorker::CAFWorker() {
     mRun = false;
     mLoopDemo = false;
     mReuseImage = false;
+    mPrefetchDepth = 4;
+    mDecodeThreads = 2;
+    mDeviceColor = false;
 
     // define supported demo types here, remember to add the enum to CAFWorker.h
     mDemoTypes[NONE] = QString("FAST");
@@ -71,24 +83,92 @@ eDemoTypes CAFWorker::getDemoType(string demoName)
     return NONE;
 }
 
-void CAFWorker::convertRGB2Gray(int** out_ptr, int& width, int& height, QImage& image)
+/// Convert one row of 32-bit pixels to gray
+static void grayRow(uchar* out, const QRgb* in, int width)
+{
+    int w = 0;
+#ifdef __SSE2__
+    // QRgb words are 0xAARRGGBB, stored as B, G, R, A bytes. Pairs of 16-bit
+    // channels are multiplied and added by madd, giving B*wb + G*wg and R*wr
+    // per pixel, which are then summed, rounded and packed 16 pixels at a time.
+    const __m128i weights = _mm_set_epi16(0, FAST_GRAY_R, FAST_GRAY_G, FAST_GRAY_B,
+                                          0, FAST_GRAY_R, FAST_GRAY_G, FAST_GRAY_B);
+    const __m128i round = _mm_set1_epi32(1 << (FAST_GRAY_SHIFT - 1));
+    const __m128i zero = _mm_setzero_si128();
+    for (; w + 16 <= width; w += 16) {
+        __m128i gray[4];
+        for (int i = 0; i < 4; i++) {
+            __m128i px = _mm_loadu_si128((const __m128i*)(in + w + 4*i));
+            __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), weights);
+            __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), weights);
+            lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+            hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+            __m128i sum = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 3, 2, 0)),
+                                             _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 3, 2, 0)));
+            gray[i] = _mm_srli_epi32(_mm_add_epi32(sum, round), FAST_GRAY_SHIFT);
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(gray[0], gray[1]),
+                                          _mm_packs_epi32(gray[2], gray[3]));
+        _mm_storeu_si128((__m128i*)(out + w), packed);
+    }
+#endif
+    for (; w < width; w++) {
+        QRgb px = in[w];
+        out[w] = (qRed(px) * FAST_GRAY_R + qGreen(px) * FAST_GRAY_G + qBlue(px) * FAST_GRAY_B +
+                  (1 << (FAST_GRAY_SHIFT - 1))) >> FAST_GRAY_SHIFT;
+    }
+}
+
+/// Convert an image to 8-bit gray. out is only reallocated when it is too
+/// small, large frames are split into bands of rows over the thread pool.
+void CAFWorker::convertRGB2Gray(std::vector<uchar>& out, int& width, int& height, const QImage& image)
 {
-    const uchar* image_ptr = image.bits();
-    //QRgb* in_data = (QRgb*)image_ptr;
     width = image.width();
     height = image.height();
+    out.resize((size_t)width * height);
+    if (out.empty())
+        return;
+
+    // Indexed and other formats are expanded first
+    QImage rgb = image;
+    if (rgb.format() != QImage::Format_RGB32 && rgb.format() != QImage::Format_ARGB32)
+        rgb = image.convertToFormat(QImage::Format_RGB32);
+
+    int bands = 1;
+    if (width * height >= GRAY_PARALLEL_PIXELS)
+        bands = std::min(height, (int)ThreadPool::global().size() * 2);
+    const int bandRows = (height + bands - 1) / bands;
+    bands = (height + bandRows - 1) / bandRows;
+
+    uchar* gray = &out[0];
+    auto convertBand = [&](unsigned b) {
+        int y1 = std::min(height, ((int)b + 1) * bandRows);
+        for (int y = b * bandRows; y < y1; y++)
+            grayRow(gray + (size_t)y * width, (const QRgb*)rgb.constScanLine(y), width);
+    };
+    if (bands > 1)
+        ThreadPool::global().run(bands, convertBand);
+    else
+        convertBand(0);
+}
 
-    *out_ptr = new int[width * height];
-    for (int h = 0; h < height; h++) {
-        for (int w = 0; w < width; w++) {
-            //(*out_ptr)[h*width+w] = qGray(in_data[h*width+w]);
-            uchar r = image_ptr[h*width*4 + w*4 + 1];
-            uchar g = image_ptr[h*width*4 + w*4 + 2];
-            uchar b = image_ptr[h*width*4 + w*4 + 3];
-            int gray = round(r*0.2126f + g*0.7152f + b*0.0722f);
-            (*out_ptr)[h*width + w] = gray;
-        }
-    }
+/// Copy an image as packed 32-bit pixels for conversion on the device. out
+/// holds 4 bytes per pixel, in the layout of QImage::Format_RGB32.
+void CAFWorker::packRGB32(std::vector<uchar>& out, int& width, int& height, const QImage& image)
+{
+    width = image.width();
+    height = image.height();
+    out.resize((size_t)width * height * sizeof(QRgb));
+    if (out.empty())
+        return;
+
+    QImage rgb = image;
+    if (rgb.format() != QImage::Format_RGB32 && rgb.format() != QImage::Format_ARGB32)
+        rgb = image.convertToFormat(QImage::Format_RGB32);
+
+    const size_t rowBytes = (size_t)width * sizeof(QRgb);
+    for (int y = 0; y < height; y++)
+        memcpy(&out[(size_t)y * rowBytes], rgb.constScanLine(y), rowBytes);
 }
 
 /// Instruct this thread to stop. Call thread.wait() to wait for termination.
@@ -108,6 +188,29 @@ void CAFWorker::setupDemo(const QString & imageDirectory, const QString & demo_n
 void CAFWorker::setLoop(bool repeatDemo)
 {
     mLoopDemo = repeatDemo;
+    mPrefetch.setLoop(repeatDemo);
+}
+
+/// Set how many frames are decoded ahead of detection, and by how many
+/// threads. Applies from the next run.
+void CAFWorker::setPrefetch(unsigned depth, unsigned threads)
+{
+    mPrefetchDepth = depth;
+    mDecodeThreads = threads;
+}
+
+/// Set the memory, in bytes, used to keep decoded frames between passes
+/// over the directory when looping. 0 decodes every frame on every pass.
+void CAFWorker::setFrameCacheSize(size_t bytes)
+{
+    mPrefetch.setCacheCapacity(bytes);
+}
+
+/// Leave the gray conversion to the detection kernel instead of the decoder
+/// threads. Applies from the next run.
+void CAFWorker::setDeviceColor(bool device)
+{
+    mDeviceColor = device;
 }
 
 /// Compute the time ellapsed in milliseconds.
@@ -140,8 +243,6 @@ void CAFWorker::run()
     QStringList imageFiles = directory.entryList(nameFilter);
 
     // locals for the loop
-    QString fileName;
-    QString imageName;
     bool firstAlgoLoop = true;
     bool noMatch = false;
     eDemoTypes demoType = getDemoType(mDemoName.toStdString());
@@ -151,21 +252,23 @@ void CAFWorker::run()
     float algoFPS = 0.0f;
     mStart = high_resolution_clock::now();
 
-    for(int i = 0; i < imageFiles.size(); i++)
+    // files are decoded and converted to gray ahead of the loop, which
+    // only waits when the decoders fall behind
+    GrayConversion convert = mDeviceColor ? &CAFWorker::packRGB32 : &CAFWorker::convertRGB2Gray;
+    mPrefetch.start(mDirectory, imageFiles, convert,
+                    mPrefetchDepth, mDecodeThreads, mLoopDemo);
+
+    PrefetchedImage frame;
+    while(mPrefetch.next(frame))
     {
         // stop if requested
         if(!mRun)
             break;
 
-        // load an image
-        imageName = imageFiles[i];
-        fileName = mDirectory + '/' + imageName;
-        QImage image(fileName.toUtf8().constData());
-
-        int* image_ptr = nullptr;
-        int image_width = 0;
-        int image_height = 0;
-        convertRGB2Gray(&image_ptr, image_width, image_height, image);
+        QImage& image = frame.mImage;
+        uchar* image_ptr = frame.mGray.data();
+        int image_width = frame.mWidth;
+        int image_height = frame.mHeight;
 
         // signal to the GUI that it should update the image
         //emit statusUpdate(mFrameCounter, mAlgorithmCounter, elapsedSeconds());
@@ -187,7 +290,11 @@ void CAFWorker::run()
 
                     std::vector<int> x, y, score;
                     auto fastTimer = high_resolution_clock::now();
-                    fast(x, y, score, image_ptr, image_width, image_height, 200, execPath);
+                    if (mDeviceColor)
+                        fastRgb(x, y, score, (const unsigned int*)image_ptr, image_width, image_height,
+                                200, execPath);
+                    else
+                        fast(x, y, score, image_ptr, image_width, image_height, 200, execPath);
                     algoFPS = 1e6f / deltaTimeMicroseconds(fastTimer);
 
                     int N = x.size();
@@ -212,17 +319,11 @@ void CAFWorker::run()
             mAlgorithmCounter++;
         }
 
-        if (image_ptr != nullptr)
-            delete[] image_ptr;
-
-        // Start the loop over if necessary
-        if(i == imageFiles.size() - 1 && mLoopDemo)
-            i = 0;
-
         // increment the frame counter
         mFrameCounter++;
 
     }
+    mPrefetch.stop();
 
     // indicate the thread has completed
     emit finished();
@@ -17,6 +17,7 @@
 #include <QImage>
 
 #include "fast.h"
+#include "imagePrefetch.h"
 
 using namespace std;
 using namespace std::chrono;
@@ -56,6 +57,11 @@ protected:
 
     std::string execPath;
 
+    unsigned mPrefetchDepth;    /// < Frames decoded ahead of detection
+    unsigned mDecodeThreads;    /// < Threads decoding them
+    ImagePrefetcher mPrefetch;
+    bool mDeviceColor;          /// < Frames go to detection in color
+
 public:
     CAFWorker();
     virtual ~CAFWorker();
@@ -67,10 +73,15 @@ public:
 
     //static af::array load_image(std::string filename);
 
-    void convertRGB2Gray(int** out_ptr, int& width, int& height, QImage& image);
+    static void convertRGB2Gray(std::vector<uchar>& out, int& width, int& height, const QImage& image);
+    static void packRGB32(std::vector<uchar>& out, int& width, int& height, const QImage& image);
 
     void setupDemo(const QString & imageDirectory, const QString & demo_name);
     void setLoop(bool repeatDemo);
+    // Tuning for applications embedding the worker; guiMain keeps the defaults.
+    void setPrefetch(unsigned depth, unsigned threads);
+    void setFrameCacheSize(size_t bytes);
+    void setDeviceColor(bool device);
 
     mapDemoTypes getDemoTypes() { return mDemoTypes; };
     eDemoTypes getDemoType(string demoName);
@@ -2,18 +2,28 @@
 // All rights reserved.
 
 #include "fast.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
 
 typedef struct
 {
     int f[3];
 } feat_t;
 
-bool feat_cmp(feat_t i, feat_t j)
+// Strongest first, equal scores in raster order so the retained set does
+// not depend on the order the device reported the features in
+bool feat_cmp(const feat_t& i, const feat_t& j)
 {
     if (i.f[2] != j.f[2])
         return (i.f[2] > j.f[2]);
+    if (i.f[1] != j.f[1])
+        return (i.f[1] < j.f[1]);
 
-    return false;
+    return (i.f[0] < j.f[0]);
 }
 
 void vec_to_feat(std::vector<feat_t>& feat, std::vector<int>& x, std::vector<int>& y, std::vector<int>& score)
@@ -41,59 +51,589 @@ void feat_to_vec(std::vector<int>& x, std::vector<int>& y, std::vector<int>& sco
     }
 }
 
-static int runOpenCL(std::vector<int>& x, std::vector<int>& y, std::vector<int>& score, double& delay,
-                     const int* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
-                     std::string kernelFile, cl_device_type deviceType, int iteration,
-                     int fast_thr, bool verbose)
+// Keeps the perCell strongest features of every grid cell, in place
+static void retainPerCell(std::vector<feat_t>& feat, const fastGrid& grid,
+                          const int imgWidth, const int imgHeight)
 {
-    static oclHardware hardware = getOclHardware(deviceType);
-    if (!hardware.mQueue) {
-        return -1;
+    size_t cells = grid.mCols * grid.mRows;
+    std::vector<std::vector<feat_t> > bucket(cells);
+    for (size_t i = 0; i < feat.size(); i++) {
+        int cx = std::min(feat[i].f[0] * grid.mCols / imgWidth, grid.mCols - 1);
+        int cy = std::min(feat[i].f[1] * grid.mRows / imgHeight, grid.mRows - 1);
+        bucket[cy * grid.mCols + cx].push_back(feat[i]);
     }
-    //std::cout << "verbose: " << verbose << std::endl;
 
-    static oclSoftware software;
-    if (strcmp(software.mKernelName, "locate_features") != 0) {
+    feat.clear();
+    for (size_t c = 0; c < cells; c++) {
+        std::vector<feat_t>& b = bucket[c];
+        if ((size_t)grid.mPerCell < b.size()) {
+            std::nth_element(b.begin(), b.begin() + grid.mPerCell, b.end(), feat_cmp);
+            b.resize(grid.mPerCell);
+        }
+        feat.insert(feat.end(), b.begin(), b.end());
+    }
+}
+
+// Keeps the maxFeatures strongest features, out of the strongest of each
+// grid cell when grid retention is on
+static void retainFeatures(std::vector<int>& x, std::vector<int>& y, std::vector<int>& score,
+                           std::vector<int>& tmp_x, std::vector<int>& tmp_y, std::vector<int>& tmp_score,
+                           const int maxFeatures, const fastGrid& grid, const int imgWidth, const int imgHeight)
+{
+    std::vector<feat_t> out_feat;
+    vec_to_feat(out_feat, tmp_x, tmp_y, tmp_score);
+
+    if (grid.mCols > 0 && grid.mRows > 0 && grid.mPerCell > 0)
+        retainPerCell(out_feat, grid, imgWidth, imgHeight);
+
+    // Only the retained features need to be ordered, the rest are just
+    // partitioned out
+    if (maxFeatures > 0 && (size_t)maxFeatures < out_feat.size()) {
+        std::nth_element(out_feat.begin(), out_feat.begin() + maxFeatures, out_feat.end(), feat_cmp);
+        out_feat.resize(maxFeatures);
+    }
+    std::sort(out_feat.begin(), out_feat.end(), feat_cmp);
+
+    feat_to_vec(x, y, score, out_feat, maxFeatures);
+}
+
+static const cl_device_type defaultDevice = CL_DEVICE_TYPE_ACCELERATOR;
+static const int defaultThreshold = 20;
+static const char defaultKernel[] = "/fast_pipeline_nonmax.xclbin";
+static const char defaultKernelSource[] = "/fast_pipeline_nonmax.cl";
+
+static bool isSourceFile(const std::string& kernelFile)
+{
+    const std::string ext(".cl");
+    return kernelFile.size() > ext.size() &&
+           kernelFile.compare(kernelFile.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// Local memory a column of locate_features takes: two buffers of
+// LOCAL_LINES + 6 image rows and LOCAL_LINES + 2 rows of scores, with the
+// LOCAL_LINES of 17 fast_pipeline_nonmax.cl is built with from source
+static const size_t localBytesPerColumn = 2 * (17 + 6) * sizeof(cl_uchar) + (17 + 2) * sizeof(cl_int);
+
+// Left to the kernel's other local variables
+static const size_t localReserve = 1024;
+
+// Widest stripe whose local buffers fit in the device's local memory, at
+// most FAST_SOURCE_WIDTH. Assumes the 32 KB every device offers when the
+// size cannot be queried.
+static int sourceWidth(const oclHardware& hardware)
+{
+    cl_ulong local = getLocalMemSize(hardware);
+    if (local == 0)
+        local = 32 << 10;
+    cl_ulong columns = local > localReserve ? (local - localReserve) / localBytesPerColumn : 0;
+    return (int)std::max<cl_ulong>(std::min<cl_ulong>(columns, FAST_SOURCE_WIDTH), 4 * FAST_STRIPE_HALO);
+}
+
+// Widest stripe, halo included, the kernel processes at once. Programs built
+// from source are specialized for the image width, up to what the local
+// memory of the device holds.
+static int kernelWidth(const oclHardware& hardware, const std::string& kernelFile, const int imgWidth)
+{
+    return isSourceFile(kernelFile) ? std::min(imgWidth, sourceWidth(hardware)) : FAST_KERNEL_WIDTH;
+}
+
+// One program per kernel width when building from source, a prebuilt binary
+// serves every width. Returns 0 when no usable kernel is available.
+static oclSoftware* oclProgram(std::map<int, oclSoftware>& programs, const oclHardware& hardware,
+                               const std::string& kernelFile, const int width)
+{
+    bool fromSource = isSourceFile(kernelFile);
+    int key = fromSource ? width : 0;
+    std::map<int, oclSoftware>::iterator it = programs.find(key);
+    if (it == programs.end()) {
+        oclSoftware& software = programs[key];
         std::memset(&software, 0, sizeof(oclSoftware));
         std::strcpy(software.mKernelName, "locate_features");
         std::strcpy(software.mFileName, kernelFile.c_str());
+        if (fromSource)
+            std::snprintf(software.mCompileOptions, sizeof(software.mCompileOptions), "-DWIDTH=%d", width);
 
         getOclSoftware(software, hardware);
+        it = programs.find(key);
     }
+    return it->second.mKernel ? &it->second : 0;
+}
 
-    size_t imgEl = imgWidth*imgHeight;
+// No two neighbouring pixels survive the 3x3 non-maximal suppression, so a
+// quarter of the image bounds the number of features
+static cl_uint maxFeatureCount(const int imgWidth, const int imgHeight)
+{
+    return ((imgWidth + 1) / 2) * ((imgHeight + 1) / 2);
+}
 
-    cl_int err = 0;
+// Kernel name of the program, created the first time it is needed. Returns
+// 0 when the program has no such kernel.
+static cl_kernel programKernel(std::map<cl_program, cl_kernel>& kernels, const oclSoftware& software,
+                               const char* name)
+{
+    std::map<cl_program, cl_kernel>::iterator it = kernels.find(software.mProgram);
+    if (it == kernels.end()) {
+        cl_int err = 0;
+        cl_kernel kernel = clCreateKernel(software.mProgram, name, &err);
+        it = kernels.insert(std::make_pair(software.mProgram, err == CL_SUCCESS ? kernel : (cl_kernel)0)).first;
+    }
+    return it->second;
+}
 
-    cl_mem d_img = clCreateBuffer(hardware.mContext, CL_MEM_READ_ONLY, imgEl * sizeof(int), NULL, &err);
-    CL_CHECK(err);
-    cl_mem d_score = clCreateBuffer(hardware.mContext, CL_MEM_READ_WRITE, imgEl * sizeof(int), NULL, &err);
-    CL_CHECK(err);
+static cl_kernel colorKernel(std::map<cl_program, cl_kernel>& kernels, const oclSoftware& software)
+{
+    return programKernel(kernels, software, "locate_features_rgb");
+}
 
-    CL_CHECK(clEnqueueWriteBuffer(hardware.mQueue, d_img, CL_TRUE, 0,
-                                  imgEl * sizeof(int), imgPtr, 0, 0, 0));
+// Host conversion of packed 0xAARRGGBB pixels, same result as the kernel
+static void rgbToGray(std::vector<unsigned char>& gray, const unsigned int* rgb, size_t n)
+{
+    gray.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        unsigned int px = rgb[i];
+        gray[i] = (((px >> 16) & 0xff) * FAST_GRAY_R + ((px >> 8) & 0xff) * FAST_GRAY_G +
+                   (px & 0xff) * FAST_GRAY_B + (1 << (FAST_GRAY_SHIFT - 1))) >> FAST_GRAY_SHIFT;
+    }
+}
 
+// Enqueues the kernel once per stripe of columns that fits its local
+// buffers, all of them appending to the same feature list. Optionally
+// returns the events of the first and the last launch.
+static int enqueueStripes(cl_command_queue queue, cl_kernel kernel, const int width,
+                          cl_mem d_img, const int imgWidth, const int imgHeight,
+                          cl_mem d_features, cl_mem d_count, const cl_uint maxCandidates, const int fast_thr,
+                          cl_uint numWait, const cl_event* waitList, cl_event* first, cl_event* last)
+{
     int arg = 0;
 
     const unsigned edge = 3;
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_mem), &d_img));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &imgWidth));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &imgHeight));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(cl_mem), &d_score));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(int), &fast_thr));
-    CL_CHECK(clSetKernelArg(software.mKernel, arg++, sizeof(unsigned), &edge));
+    const int stripe = (width >= imgWidth) ? imgWidth : width - 2 * FAST_STRIPE_HALO;
+    CL_CHECK(clSetKernelArg(kernel, arg++, sizeof(cl_mem), &d_img));
+    CL_CHECK(clSetKernelArg(kernel, arg++, sizeof(int), &imgWidth));
+    CL_CHECK(clSetKernelArg(kernel, arg++, sizeof(int), &imgHeight));
+    const int stripeArg = arg;
+    arg += 2;
+    CL_CHECK(clSetKernelArg(kernel, arg++, sizeof(cl_mem), &d_features));
+    CL_CHECK(clSetKernelArg(kernel, arg++, sizeof(cl_mem), &d_count));
+    CL_CHECK(clSetKernelArg(kernel, arg++, sizeof(cl_uint), &maxCandidates));
+    CL_CHECK(clSetKernelArg(kernel, arg++, sizeof(int), &fast_thr));
+    CL_CHECK(clSetKernelArg(kernel, arg++, sizeof(unsigned), &edge));
 
     size_t localSize[2] = { FAST_THREADS_X, FAST_THREADS_Y };
-
     size_t globalSize[2] = { 1, 1 };
 
+    for (int x0 = 0; x0 < imgWidth; x0 += stripe) {
+        CL_CHECK(clSetKernelArg(kernel, stripeArg, sizeof(int), &x0));
+        CL_CHECK(clSetKernelArg(kernel, stripeArg + 1, sizeof(int), &stripe));
+
+        bool isFirst = (x0 == 0);
+        bool isLast = (x0 + stripe >= imgWidth);
+        cl_event ev = 0;
+        CL_CHECK(clEnqueueNDRangeKernel(queue, kernel, 2, 0, globalSize, localSize,
+                                        isFirst ? numWait : 0, isFirst ? waitList : 0,
+                                        (first || last) ? &ev : 0));
+        if (!ev)
+            continue;
+        if (isFirst && first) {
+            *first = ev;
+            clRetainEvent(ev);
+        }
+        if (isLast && last) {
+            *last = ev;
+            clRetainEvent(ev);
+        }
+        clReleaseEvent(ev);
+    }
+    return 0;
+}
+
+// Device buffers and their host counterparts, shared by all calls to
+// runOpenCL(). They are only reallocated when a frame larger than every
+// previous one arrives.
+struct oclBufferPool {
+    cl_mem mImage;
+    cl_mem mFeatures;           // (x, y, score) triplets written by the kernel
+    cl_mem mCount;              // Number of features the kernel found
+    size_t mCapacity;           // Bytes mImage can hold
+    size_t mMaxFeatures;        // Triplets mFeatures can hold
+    std::vector<int> mHostFeatures;
+    unsigned long mHits;
+    unsigned long mMisses;
+    bool mPinned;               // Allocated with CL_MEM_ALLOC_HOST_PTR
+    void* mMappedImage;         // mImage mapped by fastMapImage(), until the next frame
+};
+
+static int unmapImage(oclBufferPool& pool, cl_command_queue queue, cl_event* event = 0)
+{
+    if (!pool.mMappedImage)
+        return 0;
+    void* mapped = pool.mMappedImage;
+    pool.mMappedImage = 0;
+    CL_CHECK(clEnqueueUnmapMemObject(queue, pool.mImage, mapped, 0, 0, event));
+    return 0;
+}
+
+static void releaseBuffers(oclBufferPool& pool, cl_command_queue queue)
+{
+    unmapImage(pool, queue);
+    if (pool.mImage)
+        clReleaseMemObject(pool.mImage);
+    if (pool.mFeatures)
+        clReleaseMemObject(pool.mFeatures);
+    if (pool.mCount)
+        clReleaseMemObject(pool.mCount);
+    pool.mImage = 0;
+    pool.mFeatures = 0;
+    pool.mCount = 0;
+    pool.mCapacity = 0;
+    pool.mMaxFeatures = 0;
+}
+
+static bool buffersFit(const oclBufferPool& pool, size_t imgBytes, size_t maxFeatures, bool pinned)
+{
+    return pool.mImage && pool.mCapacity >= imgBytes && pool.mMaxFeatures >= maxFeatures &&
+           pool.mPinned == pinned;
+}
+
+static int acquireBuffers(oclBufferPool& pool, const oclHardware& hardware, size_t imgBytes, size_t maxFeatures,
+                          bool pinned)
+{
+    if (buffersFit(pool, imgBytes, maxFeatures, pinned)) {
+        pool.mHits++;
+        return 0;
+    }
+    pool.mMisses++;
+
+    if (pool.mPinned == pinned) {
+        imgBytes = std::max(imgBytes, pool.mCapacity);
+        maxFeatures = std::max(maxFeatures, pool.mMaxFeatures);
+    }
+    releaseBuffers(pool, hardware.mQueue);
+
+    // Host allocated buffers are page locked, the device transfers them
+    // directly and CPU devices use them in place
+    const cl_mem_flags host = pinned ? CL_MEM_ALLOC_HOST_PTR : 0;
+    cl_int err = 0;
+    pool.mImage = clCreateBuffer(hardware.mContext, CL_MEM_READ_ONLY | host, imgBytes, NULL, &err);
+    CL_CHECK(err);
+    pool.mFeatures = clCreateBuffer(hardware.mContext, CL_MEM_WRITE_ONLY | host, maxFeatures * 3 * sizeof(int),
+                                    NULL, &err);
+    CL_CHECK(err);
+    pool.mCount = clCreateBuffer(hardware.mContext, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
+    CL_CHECK(err);
+
+    // Pinned features are mapped in place instead
+    pool.mHostFeatures.resize(pinned ? 0 : maxFeatures * 3);
+    pool.mCapacity = imgBytes;
+    pool.mMaxFeatures = maxFeatures;
+    pool.mPinned = pinned;
+    return 0;
+}
+
+// Streaming mode: every frame in flight owns a slot with its own buffers.
+// Uploads, kernels and readbacks go to three in-order queues chained by
+// events, so the transfers of neighbouring frames overlap the kernel.
+struct oclStreamSlot {
+    oclBufferPool mBuffers;
+    cl_uint mMaxCandidates;
+    cl_uint mPrefix;            // Triplets read back along with the count
+    cl_uint mCount;
+    int mMaxFeatures;
+    int mThreshold;             // Threshold the frame is detected with
+    size_t mCandidates;         // Features detected before retention
+    fastGrid mGrid;             // Retention settings at submission
+    int mWidth;
+    int mHeight;
+    std::vector<unsigned char> mHostImage;
+    cl_event mUpload;
+    cl_event mKernelFirst;      // Launch for the first and the last stripe
+    cl_event mKernel;
+    cl_event mRead;
+    bool mHost;                 // Detected on the host, results already in mX/mY/mScore
+    std::vector<int> mX, mY, mScore;
+
+    oclStreamSlot()
+        : mBuffers(), mMaxCandidates(0), mPrefix(0), mCount(0), mMaxFeatures(0), mThreshold(defaultThreshold),
+          mCandidates(0), mGrid(), mWidth(0), mHeight(0), mUpload(0), mKernelFirst(0), mKernel(0), mRead(0),
+          mHost(false) {}
+};
+
+struct oclStream {
+    cl_command_queue mUploadQueue;
+    cl_command_queue mComputeQueue;
+    cl_command_queue mReadQueue;
+    // locate_features of the context's programs. The stream sets the
+    // arguments of kernels of its own, which blocking frames do not touch.
+    std::map<cl_program, cl_kernel> mKernels;
+    oclStreamSlot mSlots[FAST_STREAM_DEPTH];
+    unsigned long mSubmitted;
+    unsigned long mCompleted;
+    cl_uint mLastCount;
+    int mThreshold;             // Threshold for the next frame submitted
+    cl_ulong mFirstStart;
+    cl_ulong mLastEnd;
+    fastStreamStats mStats;
+
+    oclStream()
+        : mUploadQueue(0), mComputeQueue(0), mReadQueue(0), mSubmitted(0), mCompleted(0), mLastCount(0),
+          mThreshold(defaultThreshold), mFirstStart(0), mLastEnd(0), mStats() {}
+};
+
+static void releaseEvents(oclStreamSlot& slot)
+{
+    if (slot.mUpload)
+        clReleaseEvent(slot.mUpload);
+    if (slot.mKernelFirst)
+        clReleaseEvent(slot.mKernelFirst);
+    if (slot.mKernel)
+        clReleaseEvent(slot.mKernel);
+    if (slot.mRead)
+        clReleaseEvent(slot.mRead);
+    slot.mUpload = 0;
+    slot.mKernelFirst = 0;
+    slot.mKernel = 0;
+    slot.mRead = 0;
+}
+
+// Waits for the frames still in flight and releases them with the queues
+static void releaseStream(oclStream& s)
+{
+    if (!s.mUploadQueue)
+        return;
+    clFinish(s.mUploadQueue);
+    clFinish(s.mComputeQueue);
+    clFinish(s.mReadQueue);
+    for (int i = 0; i < FAST_STREAM_DEPTH; i++) {
+        releaseEvents(s.mSlots[i]);
+        releaseBuffers(s.mSlots[i].mBuffers, s.mUploadQueue);
+    }
+    for (std::map<cl_program, cl_kernel>::iterator it = s.mKernels.begin(); it != s.mKernels.end(); ++it) {
+        if (it->second)
+            clReleaseKernel(it->second);
+    }
+    clReleaseCommandQueue(s.mUploadQueue);
+    clReleaseCommandQueue(s.mComputeQueue);
+    clReleaseCommandQueue(s.mReadQueue);
+}
+
+// Everything blocking detection and the streaming mode need, owned by a
+// FastContext. Contexts share nothing, the mutex serializes the callers of
+// one context.
+struct oclContext {
+    std::mutex mMutex;
+    cl_device_type mDeviceType;
+    FastBackend mBackend;
+    std::string mExecPath;
+    bool mOpened;               // Device lookup done, mHardware.mQueue is 0 when none was found
+    oclHardware mHardware;
+    std::map<int, oclSoftware> mPrograms;
+    std::map<cl_program, cl_kernel> mColorKernels;
+    oclBufferPool mBuffers;
+    bool mPinned;               // Buffers allocated with CL_MEM_ALLOC_HOST_PTR
+    fastGrid mGrid;
+    fastThresholdControl mControl;
+    int mThreshold;             // Threshold of the next frame
+    bool mProfiling;            // Frames are timed, see fastSetProfiling()
+    bool mQueueProfiling;       // mHardware.mQueue was created with CL_QUEUE_PROFILING_ENABLE
+    fastProfile mProfile;
+    oclStream mStream;          // Frames of fastSubmit(), same device and programs
+
+    oclContext(const std::string& execPath, cl_device_type deviceType, FastBackend backend)
+        : mDeviceType(deviceType), mBackend(backend), mExecPath(execPath), mOpened(false),
+          mHardware(), mBuffers(), mPinned(false), mGrid(), mControl(), mThreshold(defaultThreshold),
+          mProfiling(false), mQueueProfiling(false), mProfile(), mStream() {}
+};
+
+// Backs fast(), fastRgb(), fastSubmit() and fastPoll(). Never released, like the
+// function statics it replaces.
+static oclContext& defaultContext()
+{
+    static oclContext* context = new oclContext("", defaultDevice, FAST_BACKEND_AUTO);
+    return *context;
+}
+
+// Opened on first use, so contexts that end up on the host never touch
+// OpenCL. Called with mMutex held.
+static oclHardware& openDevice(oclContext& c)
+{
+    if (!c.mOpened) {
+        c.mHardware = getOclHardware(c.mDeviceType, c.mProfiling ? CL_QUEUE_PROFILING_ENABLE : 0);
+        c.mQueueProfiling = c.mProfiling;
+        c.mOpened = true;
+    }
+    return c.mHardware;
+}
+
+// Replaces the queue when profiling was switched after the device was
+// opened. Buffers belong to the OpenCL context, so they are kept, and a
+// mapped image is unmapped through the new queue.
+static int profileQueue(oclContext& c)
+{
+    oclHardware& hardware = c.mHardware;
+    if (c.mQueueProfiling == c.mProfiling)
+        return 0;
+    cl_int err = 0;
+    cl_command_queue queue = clCreateCommandQueue(hardware.mContext, hardware.mDevice,
+                                                  c.mProfiling ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+    CL_CHECK(err);
+    clFinish(hardware.mQueue);
+    clReleaseCommandQueue(hardware.mQueue);
+    hardware.mQueue = queue;
+    c.mQueueProfiling = c.mProfiling;
+    return 0;
+}
+
+// Events of the commands of a profiled frame, by stage. Released by
+// addEventTimes(), or here when the frame fails.
+struct oclFrameEvents {
+    bool mProfiling;
+    std::vector<cl_event> mUpload;
+    std::vector<cl_event> mKernel;
+    std::vector<cl_event> mRead;
+
+    explicit oclFrameEvents(bool profiling) : mProfiling(profiling) {}
+    ~oclFrameEvents() {
+        release(mUpload);
+        release(mKernel);
+        release(mRead);
+    }
+
+    // Where the next command of stage stores its event, null when the
+    // frame is not profiled
+    cl_event* next(std::vector<cl_event>& stage) {
+        if (!mProfiling)
+            return 0;
+        stage.push_back(0);
+        return &stage.back();
+    }
+
+    static void release(std::vector<cl_event>& events) {
+        for (size_t i = 0; i < events.size(); i++) {
+            if (events[i])
+                clReleaseEvent(events[i]);
+        }
+    }
+};
+
+// Accelerators load the prebuilt binary, other devices build from source
+static std::string kernelPath(const std::string& execPath, cl_device_type deviceType)
+{
+    return execPath + (deviceType == CL_DEVICE_TYPE_ACCELERATOR ? defaultKernel : defaultKernelSource);
+}
+
+static void releaseContext(oclContext& c)
+{
+    if (!c.mHardware.mQueue)
+        return;
+    releaseStream(c.mStream);
+    releaseBuffers(c.mBuffers, c.mHardware.mQueue);
+    for (std::map<cl_program, cl_kernel>::iterator it = c.mColorKernels.begin(); it != c.mColorKernels.end(); ++it) {
+        if (it->second)
+            clReleaseKernel(it->second);
+    }
+    for (std::map<int, oclSoftware>::iterator it = c.mPrograms.begin(); it != c.mPrograms.end(); ++it)
+        release(it->second);
+    release(c.mHardware);
+}
+
+static int mapImage(oclBufferPool& pool, const oclHardware& hardware, size_t imgBytes, size_t maxFeatures,
+                    bool pinned)
+{
+    if (unmapImage(pool, hardware.mQueue) ||
+        acquireBuffers(pool, hardware, imgBytes, maxFeatures, pinned)) {
+        return -1;
+    }
+    cl_int err = 0;
+    void* mapped = clEnqueueMapBuffer(hardware.mQueue, pool.mImage, CL_TRUE, CL_MAP_WRITE, 0, imgBytes,
+                                      0, 0, 0, &err);
+    CL_CHECK(err);
+    pool.mMappedImage = mapped;
+    return 0;
+}
+
+// Called with mMutex held
+static void* mapImage(oclContext& c, const int imgWidth, const int imgHeight, bool rgb)
+{
+    oclHardware& hardware = openDevice(c);
+    if (!hardware.mQueue) {
+        return 0;
+    }
+    size_t imgBytes = (size_t)imgWidth * imgHeight * (rgb ? sizeof(cl_uint) : sizeof(cl_uchar));
+    if (mapImage(c.mBuffers, hardware, imgBytes, maxFeatureCount(imgWidth, imgHeight), c.mPinned)) {
+        return 0;
+    }
+    return c.mBuffers.mMappedImage;
+}
+
+// Called with mMutex held
+static int runOpenCL(oclContext& c, std::vector<int>& x, std::vector<int>& y, std::vector<int>& score,
+                     double& delay, const void* imgPtr, bool rgb, const int imgWidth, const int imgHeight,
+                     const int maxFeatures, std::string kernelFile, int iteration,
+                     int fast_thr, bool verbose, size_t& candidates)
+{
+    oclHardware& hardware = openDevice(c);
+    if (!hardware.mQueue || profileQueue(c)) {
+        return -1;
+    }
+    //std::cout << "verbose: " << verbose << std::endl;
+
+    const int width = kernelWidth(hardware, kernelFile, imgWidth);
+    oclSoftware* program = oclProgram(c.mPrograms, hardware, kernelFile, width);
+    if (!program) {
+        return -1;
+    }
+    oclSoftware& software = *program;
+    oclBufferPool& pool = c.mBuffers;
+
+    size_t imgEl = imgWidth*imgHeight;
+    const cl_uint maxCandidates = maxFeatureCount(imgWidth, imgHeight);
+
+    // A frame the caller wrote into the mapped image is not copied again
+    const bool mapped = imgPtr && imgPtr == pool.mMappedImage;
+
+    // Color frames go up as they are when the binary can convert them
+    cl_kernel kernel = software.mKernel;
+    size_t imgBytes = imgEl * sizeof(cl_uchar);
+    std::vector<unsigned char> gray;
+    if (rgb) {
+        cl_kernel rgbKernel = colorKernel(c.mColorKernels, software);
+        if (rgbKernel) {
+            kernel = rgbKernel;
+            imgBytes = imgEl * sizeof(cl_uint);
+        } else {
+            rgbToGray(gray, (const unsigned int*)imgPtr, imgEl);
+            imgPtr = &gray[0];
+        }
+    }
+
+    // Reallocating would drop the mapped frame
+    if (mapped && !buffersFit(pool, imgBytes, maxCandidates, c.mPinned)) {
+        return -1;
+    }
+    if (acquireBuffers(pool, hardware, imgBytes, maxCandidates, c.mPinned)) {
+        return -1;
+    }
+    cl_mem d_img = pool.mImage;
+    cl_mem d_features = pool.mFeatures;
+    cl_mem d_count = pool.mCount;
+
+    // Unmapping hands the frame to the device. Frames converted on the host
+    // or kept elsewhere by the caller are uploaded.
+    oclFrameEvents events(c.mProfiling);
+    const bool inPlace = imgPtr == pool.mMappedImage;
+    if (unmapImage(pool, hardware.mQueue, inPlace ? events.next(events.mUpload) : 0)) {
+        return -1;
+    }
+    if (!inPlace) {
+        CL_CHECK(clEnqueueWriteBuffer(hardware.mQueue, d_img, CL_TRUE, 0,
+                                      imgBytes, imgPtr, 0, 0, events.next(events.mUpload)));
+    }
+
     if (verbose) {
-        std::cout << "Global size = (" << globalSize[0] << "," << globalSize[1] << ",1)" << std::endl;
-        std::cout << "Local  size = (" << localSize[0] << "," << localSize[1] << ",1)" << std::endl;
+        std::cout << "Kernel width = " << width << std::endl;
     }
 
-    std::vector<int> h_score_init(imgEl, 0);
-    int* h_score = new int[imgEl];
+    int* h_features = pool.mPinned ? 0 : &pool.mHostFeatures[0];
 
     std::vector<int> tmp_x, tmp_y, tmp_score;
 
@@ -101,70 +641,911 @@ static int runOpenCL(std::vector<int>& x, std::vector<int>& y, std::vector<int>&
     for(int i = 0; i < iteration; i++)
     {
         // Here we start measurings host time for kernel execution
-        CL_CHECK(clEnqueueWriteBuffer(hardware.mQueue, d_score, CL_TRUE, 0,
-                                      imgEl * sizeof(int), &h_score_init[0], 0, 0, 0));
+        static const cl_uint zero = 0;
+        CL_CHECK(clEnqueueWriteBuffer(hardware.mQueue, d_count, CL_FALSE, 0,
+                                      sizeof(cl_uint), &zero, 0, 0, events.next(events.mUpload)));
 
-        CL_CHECK(clEnqueueNDRangeKernel(hardware.mQueue, software.mKernel, 2, 0,
-                                        globalSize, localSize, 0, 0, 0));
+        cl_event first = 0, last = 0;
+        int err = enqueueStripes(hardware.mQueue, kernel, width, d_img, imgWidth, imgHeight, d_features,
+                                 d_count, maxCandidates, fast_thr, 0, 0, c.mProfiling ? &first : 0,
+                                 c.mProfiling ? &last : 0);
+        events.mKernel.push_back(first);
+        events.mKernel.push_back(last);
+        if (err) {
+            return -1;
+        }
 
-        CL_CHECK(clFinish(hardware.mQueue));
+        // Only the count and the used part of the list come back
+        cl_uint count = 0;
+        CL_CHECK(clEnqueueReadBuffer(hardware.mQueue, d_count, CL_TRUE, 0,
+                                     sizeof(cl_uint), &count, 0, 0, events.next(events.mRead)));
+        count = std::min(count, maxCandidates);
+        candidates = count;
 
-        CL_CHECK(clEnqueueReadBuffer(hardware.mQueue, d_score, CL_TRUE, 0,
-                                     imgEl * sizeof(int), h_score, 0, 0, 0));
+        // Pinned features are read where the device left them
+        if (count > 0 && pool.mPinned) {
+            cl_int err = 0;
+            h_features = (int*)clEnqueueMapBuffer(hardware.mQueue, d_features, CL_TRUE, CL_MAP_READ, 0,
+                                                  count * 3 * sizeof(int), 0, 0,
+                                                  events.next(events.mRead), &err);
+            CL_CHECK(err);
+        }
+        else if (count > 0) {
+            CL_CHECK(clEnqueueReadBuffer(hardware.mQueue, d_features, CL_TRUE, 0,
+                                         count * 3 * sizeof(int), h_features, 0, 0,
+                                         events.next(events.mRead)));
+        }
 
         if (i == iteration-1) {
-            //auto startTime = std::chrono::high_resolution_clock::now();
-            for (size_t j = 0; j < imgHeight; j++) {
-                for (size_t k = 0; k < imgWidth; k++) {
-                    size_t idx = j*imgWidth + k;
-                    int s = h_score[idx];
-                    if (s != 0) {
-                        tmp_x.push_back(k);
-                        tmp_y.push_back(j);
-                        tmp_score.push_back(s);
-
-                        if (verbose)
-                            std::cout << "(" << k << ", " << j << "): " << s << std::endl;
-                    }
-                }
+            tmp_x.resize(count);
+            tmp_y.resize(count);
+            tmp_score.resize(count);
+            for (size_t j = 0; j < count; j++) {
+                tmp_x[j] = h_features[3*j + 0];
+                tmp_y[j] = h_features[3*j + 1];
+                tmp_score[j] = h_features[3*j + 2];
+
+                if (verbose)
+                    std::cout << "(" << tmp_x[j] << ", " << tmp_y[j] << "): " << tmp_score[j] << std::endl;
             }
-            //auto endTime = std::chrono::high_resolution_clock::now();
-            //int detTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
-            //std::cout << "Feature detection time: " << detTime << std::endl;
 
-            //startTime = std::chrono::high_resolution_clock::now();
-            std::vector<feat_t> out_feat;
-            vec_to_feat(out_feat, tmp_x, tmp_y, tmp_score);
-            std::sort(out_feat.begin(), out_feat.end(), feat_cmp);
+            retainFeatures(x, y, score, tmp_x, tmp_y, tmp_score, maxFeatures, c.mGrid,
+                           imgWidth, imgHeight);
+        }
 
-            feat_to_vec(x, y, score, out_feat, maxFeatures);
-            //endTime = std::chrono::high_resolution_clock::now();
-            //int sortTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
-            //std::cout << "Feature sorting time: " << sortTime << std::endl;
+        if (count > 0 && pool.mPinned) {
+            CL_CHECK(clEnqueueUnmapMemObject(hardware.mQueue, d_features, h_features, 0, 0,
+                                             events.next(events.mRead)));
         }
     }
     delay = timer.stop();
 
-    delete[] h_score;
-    clReleaseMemObject(d_img);
-    clReleaseMemObject(d_score);
+    if (c.mProfiling) {
+        CL_CHECK(clFinish(hardware.mQueue));
+        fastProfile& profile = c.mProfile;
+        if (addEventTimes(profile.mUpload, events.mUpload) || addEventTimes(profile.mKernel, events.mKernel) ||
+            addEventTimes(profile.mRead, events.mRead)) {
+            std::cout << "No profiling information for the frame" << std::endl;
+        }
+        profile.mFrames++;
+    }
+    return 0;
+}
+
+static int runCpu(std::vector<int>& x, std::vector<int>& y, std::vector<int>& score, double& delay,
+                  const unsigned char* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
+                  int iteration, int fast_thr, bool verbose, size_t& candidates, const fastGrid& grid)
+{
+    std::vector<int> tmp_x, tmp_y, tmp_score;
+
+    Timer timer;
+    for(int i = 0; i < iteration; i++)
+    {
+        if (fastCpu(tmp_x, tmp_y, tmp_score, imgPtr, imgWidth, imgHeight, fast_thr))
+            return -1;
+    }
+
+    if (verbose) {
+        for (size_t j = 0; j < tmp_x.size(); j++)
+            std::cout << "(" << tmp_x[j] << ", " << tmp_y[j] << "): " << tmp_score[j] << std::endl;
+    }
+
+    candidates = tmp_x.size();
+    retainFeatures(x, y, score, tmp_x, tmp_y, tmp_score, maxFeatures, grid, imgWidth, imgHeight);
+    delay = timer.stop();
+
+    return 0;
+}
+
+static int clampThreshold(const fastThresholdControl& control, int thr)
+{
+    if (control.mTarget <= 0)
+        return defaultThreshold;
+    return std::min(std::max(thr, control.mMin), control.mMax);
+}
+
+// Threshold for the frame following one detected with thr that had
+// candidates features. The count falls off steeply as the threshold rises,
+// so it moves by a quarter when the count is off by more than a factor of
+// two and by one otherwise.
+static int nextThreshold(const fastThresholdControl& control, int thr, size_t candidates)
+{
+    if (control.mTarget <= 0)
+        return defaultThreshold;
+
+    size_t target = control.mTarget;
+    size_t low = target * (100 - std::min(control.mTolerance, 100)) / 100;
+    size_t high = target * (100 + control.mTolerance) / 100;
+    int step = std::max(thr / 4, 2);
+    if (candidates > high)
+        thr += candidates > 2 * target ? step : 1;
+    else if (candidates < low)
+        thr -= 2 * candidates < target ? step : 1;
 
+    return clampThreshold(control, thr);
+}
+
+// Smallest number of features read back with the count, the prefix grows
+// with the count of the previous frame
+static const cl_uint minStreamPrefix = 1024;
+
+static int createStreamQueues(oclStream& s, const oclHardware& hardware)
+{
+    if (s.mUploadQueue)
+        return 0;
+
+    cl_int err = 0;
+    cl_command_queue_properties props = CL_QUEUE_PROFILING_ENABLE;
+    s.mUploadQueue = clCreateCommandQueue(hardware.mContext, hardware.mDevice, props, &err);
+    CL_CHECK(err);
+    s.mComputeQueue = clCreateCommandQueue(hardware.mContext, hardware.mDevice, props, &err);
+    CL_CHECK(err);
+    s.mReadQueue = clCreateCommandQueue(hardware.mContext, hardware.mDevice, props, &err);
+    CL_CHECK(err);
     return 0;
 }
 
-int fast(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
-         const int* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
-         const std::string execPath)
+static double eventMs(cl_event ev, cl_ulong& start, cl_ulong& end)
+{
+    start = end = 0;
+    if (clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, 0) != CL_SUCCESS ||
+        clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, 0) != CL_SUCCESS)
+        return 0;
+    return (end - start) * 1e-6;
+}
+
+// The stream shares the device and the programs of its context. Called with
+// mMutex held.
+static int submitOpenCL(oclContext& c, oclStreamSlot& slot, const unsigned char* imgPtr,
+                        const int imgWidth, const int imgHeight, const std::string& kernelFile, int fast_thr)
 {
-    cl_device_type deviceType = CL_DEVICE_TYPE_ACCELERATOR;
-    std::string kernelFile(execPath + "/fast_pipeline_nonmax.xclbin");
+    oclStream& s = c.mStream;
+    const oclHardware& hardware = openDevice(c);
+    if (!hardware.mQueue) {
+        return -1;
+    }
+    const int width = kernelWidth(hardware, kernelFile, imgWidth);
+    oclSoftware* program = oclProgram(c.mPrograms, hardware, kernelFile, width);
+    if (!program) {
+        return -1;
+    }
+    cl_kernel kernel = programKernel(s.mKernels, *program, "locate_features");
+    if (!kernel || createStreamQueues(s, hardware)) {
+        return -1;
+    }
+
+    size_t imgEl = imgWidth*imgHeight;
+    slot.mMaxCandidates = maxFeatureCount(imgWidth, imgHeight);
+    if (acquireBuffers(slot.mBuffers, hardware, imgEl * sizeof(cl_uchar), slot.mMaxCandidates, false)) {
+        return -1;
+    }
+    slot.mPrefix = std::min(slot.mMaxCandidates, std::max(minStreamPrefix, 2 * s.mLastCount));
+
+    // The caller's image may be gone before the upload runs
+    slot.mHostImage.assign(imgPtr, imgPtr + imgEl);
+
+    static const cl_uint zero = 0;
+    CL_CHECK(clEnqueueWriteBuffer(s.mUploadQueue, slot.mBuffers.mCount, CL_FALSE, 0,
+                                  sizeof(cl_uint), &zero, 0, 0, 0));
+    CL_CHECK(clEnqueueWriteBuffer(s.mUploadQueue, slot.mBuffers.mImage, CL_FALSE, 0,
+                                  imgEl * sizeof(cl_uchar), &slot.mHostImage[0], 0, 0, &slot.mUpload));
+
+    if (enqueueStripes(s.mComputeQueue, kernel, width, slot.mBuffers.mImage, imgWidth, imgHeight,
+                       slot.mBuffers.mFeatures, slot.mBuffers.mCount, slot.mMaxCandidates, fast_thr,
+                       1, &slot.mUpload, &slot.mKernelFirst, &slot.mKernel)) {
+        return -1;
+    }
+
+    CL_CHECK(clEnqueueReadBuffer(s.mReadQueue, slot.mBuffers.mCount, CL_FALSE, 0,
+                                 sizeof(cl_uint), &slot.mCount, 1, &slot.mKernel, 0));
+    CL_CHECK(clEnqueueReadBuffer(s.mReadQueue, slot.mBuffers.mFeatures, CL_FALSE, 0,
+                                 slot.mPrefix * 3 * sizeof(int), &slot.mBuffers.mHostFeatures[0],
+                                 1, &slot.mKernel, &slot.mRead));
+
+    CL_CHECK(clFlush(s.mUploadQueue));
+    CL_CHECK(clFlush(s.mComputeQueue));
+    CL_CHECK(clFlush(s.mReadQueue));
+    return 0;
+}
+
+static int completeOpenCL(oclStream& s, oclStreamSlot& slot, std::vector<int>& x, std::vector<int>& y,
+                          std::vector<int>& score)
+{
+    CL_CHECK(clWaitForEvents(1, &slot.mRead));
+
+    cl_uint count = std::min(slot.mCount, slot.mMaxCandidates);
+    int* h_features = &slot.mBuffers.mHostFeatures[0];
+    if (count > slot.mPrefix) {
+        CL_CHECK(clEnqueueReadBuffer(s.mReadQueue, slot.mBuffers.mFeatures, CL_TRUE,
+                                     slot.mPrefix * 3 * sizeof(int), (count - slot.mPrefix) * 3 * sizeof(int),
+                                     h_features + slot.mPrefix * 3, 0, 0, 0));
+    }
+    s.mLastCount = count;
+    slot.mCandidates = count;
+
+    std::vector<int> tmp_x(count), tmp_y(count), tmp_score(count);
+    for (size_t j = 0; j < count; j++) {
+        tmp_x[j] = h_features[3*j + 0];
+        tmp_y[j] = h_features[3*j + 1];
+        tmp_score[j] = h_features[3*j + 2];
+    }
+    retainFeatures(x, y, score, tmp_x, tmp_y, tmp_score, slot.mMaxFeatures, slot.mGrid,
+                   slot.mWidth, slot.mHeight);
+
+    cl_ulong start, end, readStart, readEnd;
+    s.mStats.mUploadMs += eventMs(slot.mUpload, start, end);
+    cl_ulong first = start;
+    cl_ulong kernelStart, kernelEnd;
+    eventMs(slot.mKernelFirst, kernelStart, end);
+    eventMs(slot.mKernel, start, kernelEnd);
+    if (kernelStart != 0 && kernelEnd != 0)
+        s.mStats.mKernelMs += (kernelEnd - kernelStart) * 1e-6;
+    s.mStats.mReadMs += eventMs(slot.mRead, readStart, readEnd);
+    if (first != 0 && readEnd != 0) {
+        if (s.mFirstStart == 0 || first < s.mFirstStart)
+            s.mFirstStart = first;
+        s.mLastEnd = std::max(s.mLastEnd, readEnd);
+        s.mStats.mSpanMs = (s.mLastEnd - s.mFirstStart) * 1e-6;
+    }
+
+    releaseEvents(slot);
+    return 0;
+}
+
+// Called with mMutex held
+static int submit(oclContext& c, unsigned long& ticket, const unsigned char* imgPtr, const int imgWidth,
+                  const int imgHeight, const int maxFeatures, const std::string& execPath, FastBackend backend)
+{
+    oclStream& s = c.mStream;
+    if (s.mSubmitted - s.mCompleted >= (unsigned long)FAST_STREAM_DEPTH) {
+        return 1;
+    }
+
+    oclStreamSlot& slot = s.mSlots[s.mSubmitted % FAST_STREAM_DEPTH];
+    slot.mMaxFeatures = maxFeatures;
+    slot.mThreshold = s.mThreshold;
+    slot.mGrid = c.mGrid;
+    slot.mWidth = imgWidth;
+    slot.mHeight = imgHeight;
+    slot.mHost = false;
+
+    int err = -1;
+    if (backend != FAST_BACKEND_CPU) {
+        err = submitOpenCL(c, slot, imgPtr, imgWidth, imgHeight, kernelPath(execPath, c.mDeviceType),
+                           slot.mThreshold);
+        if (err) {
+            // Commands queued before the failure still reference the slot
+            if (s.mUploadQueue) {
+                clFinish(s.mUploadQueue);
+                clFinish(s.mComputeQueue);
+                clFinish(s.mReadQueue);
+            }
+            releaseEvents(slot);
+            if (backend == FAST_BACKEND_OPENCL)
+                return err;
+        }
+    }
+
+    if (err) {
+        double delay = 0;
+        slot.mHost = true;
+        err = runCpu(slot.mX, slot.mY, slot.mScore, delay, imgPtr, imgWidth, imgHeight, maxFeatures,
+                     1, slot.mThreshold, false, slot.mCandidates, slot.mGrid);
+        if (err)
+            return err;
+    }
+
+    ticket = s.mSubmitted++;
+    return 0;
+}
+
+// Called with mMutex held
+static int poll(oclContext& c, std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+                unsigned long& ticket, bool wait, int* threshold)
+{
+    oclStream& s = c.mStream;
+    if (s.mCompleted == s.mSubmitted) {
+        return 1;
+    }
+
+    oclStreamSlot& slot = s.mSlots[s.mCompleted % FAST_STREAM_DEPTH];
+    if (slot.mHost) {
+        v_x.swap(slot.mX);
+        v_y.swap(slot.mY);
+        v_score.swap(slot.mScore);
+    } else {
+        if (!wait) {
+            cl_int status = CL_COMPLETE;
+            CL_CHECK(clGetEventInfo(slot.mRead, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                    sizeof(cl_int), &status, 0));
+            if (status > CL_COMPLETE)
+                return 1;
+        }
+        int err = completeOpenCL(s, slot, v_x, v_y, v_score);
+        if (err) {
+            // The frame is dropped, later ones can still complete
+            releaseEvents(slot);
+            ticket = s.mCompleted++;
+            return err;
+        }
+    }
+
+    // Frames still in flight were submitted with about the same threshold,
+    // so the correction is applied to the one this frame was detected with
+    // rather than accumulated once per frame
+    s.mThreshold = nextThreshold(c.mControl, slot.mThreshold, slot.mCandidates);
+    if (threshold)
+        *threshold = slot.mThreshold;
+
+    s.mStats.mFrames++;
+    ticket = s.mCompleted++;
+    return 0;
+}
+
+static fastStreamStats streamStatistics(oclContext& c)
+{
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    fastStreamStats stats = c.mStream.mStats;
+    double busy = stats.mUploadMs + stats.mKernelMs + stats.mReadMs;
+    stats.mOverlap = stats.mSpanMs > 0 ? busy / stats.mSpanMs : 1;
+    return stats;
+}
+
+int fastSubmit(unsigned long& ticket, const unsigned char* imgPtr, const int imgWidth, const int imgHeight,
+               const int maxFeatures, const std::string execPath, FastBackend backend)
+{
+    oclContext& c = defaultContext();
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    return submit(c, ticket, imgPtr, imgWidth, imgHeight, maxFeatures, execPath, backend);
+}
+
+int fastPoll(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+             unsigned long& ticket, bool wait, int* threshold)
+{
+    oclContext& c = defaultContext();
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    return poll(c, v_x, v_y, v_score, ticket, wait, threshold);
+}
+
+fastStreamStats fastStreamStatistics()
+{
+    return streamStatistics(defaultContext());
+}
+
+// Dispatcher: frames are spread over every device of a type, with several
+// queues per device so that binaries holding more than one compute unit of
+// locate_features can run as many frames at once. By default a device gets
+// one queue per compute unit it reports. Each queue is served by a host
+// thread with its own kernel and buffers. There is no work stealing, idle
+// threads take the oldest frame of one shared FIFO, as ThreadPool hands out
+// tasks, so faster devices simply detect more frames.
+struct oclDispatchFrame {
+    unsigned long mTicket;
+    std::vector<unsigned char> mImage;
+    int mWidth;
+    int mHeight;
+    int mMaxFeatures;
+    int mThreshold;
+    fastGrid mGrid;             // Retention settings at submission
+    size_t mCandidates;
+    std::vector<int> mX, mY, mScore;
+};
+
+struct oclDispatchWorker {
+    oclHardware mHardware;      // Context of the device, queue of its own
+    int mDevice;
+    cl_kernel mKernel;
+    int mWidth;                 // Stripe width of the program
+    oclBufferPool mBuffers;
+    unsigned long mFrames;
+    std::thread mThread;
+};
+
+struct oclDispatcher {
+    std::vector<oclHardware> mDevices;
+    std::vector<oclSoftware> mPrograms;
+    std::vector<oclDispatchWorker*> mWorkers;
+    std::deque<oclDispatchFrame*> mWaiting;
+    std::map<unsigned long, oclDispatchFrame*> mDone;
+    unsigned long mSubmitted;
+    unsigned long mPolled;
+    bool mStop;
+    fastGrid mGrid;
+    fastThresholdControl mControl;
+    int mThreshold;             // Threshold of the next frame submitted
+    std::mutex mMutex;
+    std::condition_variable mWork;
+    std::condition_variable mFinished;
+
+    oclDispatcher()
+        : mSubmitted(0), mPolled(0), mStop(false), mGrid(), mControl(), mThreshold(defaultThreshold) {}
+    ~oclDispatcher() { fastDispatchStop(); }
+};
+
+static oclDispatcher dispatcher;
+
+// Most devices opened by fastDispatchStart()
+static const int maxDispatchDevices = 16;
+// Most queues fastDispatchStart() opens on a device from its compute units
+static const unsigned maxDispatchQueues = 16;
+
+static int dispatchOpenCL(oclDispatchWorker& worker, oclDispatchFrame& frame)
+{
+    const size_t imgEl = (size_t)frame.mWidth * frame.mHeight;
+    const cl_uint maxCandidates = maxFeatureCount(frame.mWidth, frame.mHeight);
+    oclBufferPool& pool = worker.mBuffers;
+    if (acquireBuffers(pool, worker.mHardware, imgEl * sizeof(cl_uchar), maxCandidates, false)) {
+        return -1;
+    }
+
+    cl_command_queue queue = worker.mHardware.mQueue;
+    static const cl_uint zero = 0;
+    CL_CHECK(clEnqueueWriteBuffer(queue, pool.mCount, CL_FALSE, 0, sizeof(cl_uint), &zero, 0, 0, 0));
+    CL_CHECK(clEnqueueWriteBuffer(queue, pool.mImage, CL_FALSE, 0, imgEl * sizeof(cl_uchar),
+                                  &frame.mImage[0], 0, 0, 0));
+    if (enqueueStripes(queue, worker.mKernel, worker.mWidth, pool.mImage, frame.mWidth, frame.mHeight,
+                       pool.mFeatures, pool.mCount, maxCandidates, frame.mThreshold, 0, 0, 0, 0)) {
+        return -1;
+    }
+
+    cl_uint count = 0;
+    CL_CHECK(clEnqueueReadBuffer(queue, pool.mCount, CL_TRUE, 0, sizeof(cl_uint), &count, 0, 0, 0));
+    count = std::min(count, maxCandidates);
+    int* h_features = &pool.mHostFeatures[0];
+    if (count > 0) {
+        CL_CHECK(clEnqueueReadBuffer(queue, pool.mFeatures, CL_TRUE, 0, count * 3 * sizeof(int),
+                                     h_features, 0, 0, 0));
+    }
+
+    std::vector<int> tmp_x(count), tmp_y(count), tmp_score(count);
+    for (size_t j = 0; j < count; j++) {
+        tmp_x[j] = h_features[3*j + 0];
+        tmp_y[j] = h_features[3*j + 1];
+        tmp_score[j] = h_features[3*j + 2];
+    }
+    frame.mCandidates = count;
+    retainFeatures(frame.mX, frame.mY, frame.mScore, tmp_x, tmp_y, tmp_score, frame.mMaxFeatures,
+                   frame.mGrid, frame.mWidth, frame.mHeight);
+    return 0;
+}
+
+static void dispatchFrames(oclDispatcher& d, oclDispatchWorker& worker)
+{
+    std::unique_lock<std::mutex> lock(d.mMutex);
+    for (;;) {
+        d.mWork.wait(lock, [&] { return d.mStop || !d.mWaiting.empty(); });
+        if (d.mStop)
+            return;
+
+        oclDispatchFrame* frame = d.mWaiting.front();
+        d.mWaiting.pop_front();
+        lock.unlock();
+
+        // Frames the device fails on are detected on the host instead, once
+        // the commands queued before the failure stopped reading the frame
+        if (dispatchOpenCL(worker, *frame)) {
+            clFinish(worker.mHardware.mQueue);
+            std::vector<int> tmp_x, tmp_y, tmp_score;
+            fastCpu(tmp_x, tmp_y, tmp_score, &frame->mImage[0], frame->mWidth, frame->mHeight,
+                    frame->mThreshold);
+            frame->mCandidates = tmp_x.size();
+            retainFeatures(frame->mX, frame->mY, frame->mScore, tmp_x, tmp_y, tmp_score,
+                           frame->mMaxFeatures, frame->mGrid, frame->mWidth, frame->mHeight);
+        }
+
+        lock.lock();
+        worker.mFrames++;
+        d.mDone[frame->mTicket] = frame;
+        d.mFinished.notify_all();
+    }
+}
+
+int fastDispatchStart(const std::string execPath, cl_device_type deviceType, unsigned queuesPerDevice)
+{
+    fastDispatchStop();
+    oclDispatcher& d = dispatcher;
+
+    // Accelerators load the prebuilt binary, other devices build the
+    // pipeline kernel from source for the widest stripe they can hold
+    const bool binary = (deviceType == CL_DEVICE_TYPE_ACCELERATOR);
+    const std::string kernelFile = execPath + (binary ? defaultKernel : defaultKernelSource);
+
+    std::vector<oclHardware> devices(maxDispatchDevices);
+    int deviceCount = getOclHardware(&devices[0], maxDispatchDevices, deviceType);
+    for (int i = 0; i < deviceCount; i++) {
+        const int width = binary ? FAST_KERNEL_WIDTH : sourceWidth(devices[i]);
+        oclSoftware software;
+        std::memset(&software, 0, sizeof(oclSoftware));
+        std::strcpy(software.mKernelName, "locate_features");
+        std::strncpy(software.mFileName, kernelFile.c_str(), sizeof(software.mFileName) - 1);
+        if (!binary)
+            std::snprintf(software.mCompileOptions, sizeof(software.mCompileOptions), "-DWIDTH=%d", width);
+        getOclSoftware(software, devices[i]);
+        if (!software.mKernel) {
+            release(devices[i]);
+            continue;
+        }
+
+        unsigned queues = queuesPerDevice;
+        if (queues == 0) {
+            queues = std::min(std::max(getComputeUnits(devices[i]), 1u), maxDispatchQueues);
+        }
+
+        const int device = (int)d.mDevices.size();
+        d.mDevices.push_back(devices[i]);
+        d.mPrograms.push_back(software);
+        for (unsigned q = 0; q < queues; q++) {
+            cl_int err = 0;
+            cl_command_queue queue = clCreateCommandQueue(devices[i].mContext, devices[i].mDevice, 0, &err);
+            if (err != CL_SUCCESS)
+                break;
+            cl_kernel kernel = clCreateKernel(software.mProgram, "locate_features", &err);
+            if (err != CL_SUCCESS) {
+                clReleaseCommandQueue(queue);
+                break;
+            }
+
+            oclDispatchWorker* worker = new oclDispatchWorker();
+            worker->mHardware = devices[i];
+            worker->mHardware.mQueue = queue;
+            worker->mDevice = device;
+            worker->mKernel = kernel;
+            worker->mWidth = width;
+            worker->mBuffers = oclBufferPool();
+            worker->mFrames = 0;
+            d.mWorkers.push_back(worker);
+        }
+    }
+
+    for (size_t i = 0; i < d.mWorkers.size(); i++)
+        d.mWorkers[i]->mThread = std::thread(dispatchFrames, std::ref(d), std::ref(*d.mWorkers[i]));
+    return (int)d.mWorkers.size();
+}
+
+int fastDispatchSubmit(unsigned long& ticket, const unsigned char* imgPtr, const int imgWidth,
+                       const int imgHeight, const int maxFeatures)
+{
+    oclDispatcher& d = dispatcher;
+    std::lock_guard<std::mutex> lock(d.mMutex);
+    if (d.mWorkers.empty()) {
+        return -1;
+    }
+    if (d.mSubmitted - d.mPolled >= 2 * d.mWorkers.size()) {
+        return 1;
+    }
+
+    oclDispatchFrame* frame = new oclDispatchFrame();
+    frame->mTicket = d.mSubmitted++;
+    frame->mImage.assign(imgPtr, imgPtr + (size_t)imgWidth * imgHeight);
+    frame->mWidth = imgWidth;
+    frame->mHeight = imgHeight;
+    frame->mMaxFeatures = maxFeatures;
+    frame->mThreshold = d.mThreshold;
+    frame->mGrid = d.mGrid;
+    frame->mCandidates = 0;
+    d.mWaiting.push_back(frame);
+    d.mWork.notify_one();
+
+    ticket = frame->mTicket;
+    return 0;
+}
+
+int fastDispatchPoll(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+                     unsigned long& ticket, bool wait, int* threshold)
+{
+    oclDispatcher& d = dispatcher;
+    std::unique_lock<std::mutex> lock(d.mMutex);
+    if (d.mPolled == d.mSubmitted) {
+        return 1;
+    }
+    if (wait) {
+        d.mFinished.wait(lock, [&] { return d.mDone.count(d.mPolled) > 0; });
+    }
+    std::map<unsigned long, oclDispatchFrame*>::iterator it = d.mDone.find(d.mPolled);
+    if (it == d.mDone.end()) {
+        return 1;
+    }
+    oclDispatchFrame* frame = it->second;
+    d.mDone.erase(it);
+    d.mPolled++;
+
+    v_x.swap(frame->mX);
+    v_y.swap(frame->mY);
+    v_score.swap(frame->mScore);
+    ticket = frame->mTicket;
+    if (threshold)
+        *threshold = frame->mThreshold;
+    d.mThreshold = nextThreshold(d.mControl, frame->mThreshold, frame->mCandidates);
+    delete frame;
+    return 0;
+}
+
+void fastDispatchStop()
+{
+    oclDispatcher& d = dispatcher;
+    {
+        std::lock_guard<std::mutex> lock(d.mMutex);
+        d.mStop = true;
+    }
+    d.mWork.notify_all();
+
+    for (size_t i = 0; i < d.mWorkers.size(); i++) {
+        oclDispatchWorker* worker = d.mWorkers[i];
+        if (worker->mThread.joinable())
+            worker->mThread.join();
+        releaseBuffers(worker->mBuffers, worker->mHardware.mQueue);
+        clReleaseKernel(worker->mKernel);
+        clReleaseCommandQueue(worker->mHardware.mQueue);
+        delete worker;
+    }
+    d.mWorkers.clear();
+
+    for (size_t i = 0; i < d.mWaiting.size(); i++)
+        delete d.mWaiting[i];
+    d.mWaiting.clear();
+    for (std::map<unsigned long, oclDispatchFrame*>::iterator it = d.mDone.begin(); it != d.mDone.end(); ++it)
+        delete it->second;
+    d.mDone.clear();
+
+    for (size_t i = 0; i < d.mPrograms.size(); i++)
+        release(d.mPrograms[i]);
+    d.mPrograms.clear();
+    for (size_t i = 0; i < d.mDevices.size(); i++)
+        release(d.mDevices[i]);
+    d.mDevices.clear();
+
+    d.mSubmitted = 0;
+    d.mPolled = 0;
+    d.mStop = false;
+}
+
+fastDispatchStats fastDispatchStatistics()
+{
+    oclDispatcher& d = dispatcher;
+    std::lock_guard<std::mutex> lock(d.mMutex);
+    fastDispatchStats stats;
+    stats.mDevices = (int)d.mDevices.size();
+    for (size_t i = 0; i < d.mWorkers.size(); i++) {
+        stats.mDevice.push_back(d.mWorkers[i]->mDevice);
+        stats.mFrames.push_back(d.mWorkers[i]->mFrames);
+    }
+    return stats;
+}
+
+// Retention and threshold control of one context, for blocking frames and
+// the stream alike
+static void setGrid(oclContext& c, const fastGrid& grid)
+{
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    c.mGrid = grid;
+}
+
+static void setThresholdControl(oclContext& c, const fastThresholdControl& control)
+{
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    c.mControl = control;
+    c.mThreshold = clampThreshold(control, defaultThreshold);
+    c.mStream.mThreshold = c.mThreshold;
+}
+
+void fastSetGrid(const fastGrid& grid)
+{
+    {
+        std::lock_guard<std::mutex> lock(dispatcher.mMutex);
+        dispatcher.mGrid = grid;
+    }
+    setGrid(defaultContext(), grid);
+}
+
+void fastSetThresholdControl(const fastThresholdControl& control)
+{
+    {
+        std::lock_guard<std::mutex> lock(dispatcher.mMutex);
+        dispatcher.mControl = control;
+        dispatcher.mThreshold = clampThreshold(control, defaultThreshold);
+    }
+    setThresholdControl(defaultContext(), control);
+}
+
+// Blocking detection of a gray or, with rgb set, packed color frame
+static int detect(oclContext& c, std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+                  const void* imgPtr, bool rgb, const int imgWidth, const int imgHeight, const int maxFeatures,
+                  const std::string& execPath, FastBackend backend, int* threshold)
+{
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    std::string kernelFile(kernelPath(execPath, c.mDeviceType));
     int iteration = 1;
-    int fast_thr = 20;
+    int fast_thr = c.mThreshold;
     bool verbose = false;
     double delay = 0;
+    size_t candidates = 0;
 
-    runOpenCL(v_x, v_y, v_score, delay, imgPtr, imgWidth, imgHeight, maxFeatures,
-              kernelFile, deviceType, iteration, fast_thr, verbose);
+    int err = -1;
+    if (backend != FAST_BACKEND_CPU) {
+        const bool mapped = imgPtr == c.mBuffers.mMappedImage;
+        err = runOpenCL(c, v_x, v_y, v_score, delay, imgPtr, rgb, imgWidth, imgHeight, maxFeatures,
+                        kernelFile, iteration, fast_thr, verbose, candidates);
+        if (err && backend == FAST_BACKEND_OPENCL)
+            return err;
+        // A mapped frame already handed to the device cannot be read here
+        if (err && mapped && !c.mBuffers.mMappedImage)
+            return err;
+    }
 
+    if (err) {
+        std::vector<unsigned char> gray;
+        const unsigned char* grayPtr = (const unsigned char*)imgPtr;
+        if (rgb) {
+            rgbToGray(gray, (const unsigned int*)imgPtr, (size_t)imgWidth * imgHeight);
+            grayPtr = &gray[0];
+        }
+        err = runCpu(v_x, v_y, v_score, delay, grayPtr, imgWidth, imgHeight, maxFeatures,
+                     iteration, fast_thr, verbose, candidates, c.mGrid);
+        if (err)
+            return err;
+    }
+
+    c.mThreshold = nextThreshold(c.mControl, fast_thr, candidates);
+    if (threshold)
+        *threshold = fast_thr;
     return 0;
 }
+
+int fast(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+         const unsigned char* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
+         const std::string execPath, FastBackend backend, int* threshold)
+{
+    return detect(defaultContext(), v_x, v_y, v_score, imgPtr, false, imgWidth, imgHeight, maxFeatures,
+                  execPath, backend, threshold);
+}
+
+int fastRgb(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+            const unsigned int* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
+            const std::string execPath, FastBackend backend, int* threshold)
+{
+    return detect(defaultContext(), v_x, v_y, v_score, imgPtr, true, imgWidth, imgHeight, maxFeatures,
+                  execPath, backend, threshold);
+}
+
+void* fastMapImage(const int imgWidth, const int imgHeight, bool rgb)
+{
+    oclContext& c = defaultContext();
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    return mapImage(c, imgWidth, imgHeight, rgb);
+}
+
+void fastSetPinnedBuffers(bool pinned)
+{
+    oclContext& c = defaultContext();
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    c.mPinned = pinned;
+}
+
+fastPoolStats fastBufferPoolStats()
+{
+    oclContext& c = defaultContext();
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    fastPoolStats stats = { c.mBuffers.mHits, c.mBuffers.mMisses, c.mBuffers.mCapacity };
+    return stats;
+}
+
+static void setProfiling(oclContext& c, bool enable)
+{
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    c.mProfiling = enable;
+    std::memset(&c.mProfile, 0, sizeof(c.mProfile));
+}
+
+static fastProfile profileStatistics(oclContext& c)
+{
+    std::lock_guard<std::mutex> lock(c.mMutex);
+    return c.mProfile;
+}
+
+void fastSetProfiling(bool enable)
+{
+    setProfiling(defaultContext(), enable);
+}
+
+fastProfile fastProfileStatistics()
+{
+    return profileStatistics(defaultContext());
+}
+
+FastContext::FastContext(const std::string execPath, cl_device_type deviceType, FastBackend backend)
+    : mContext(new oclContext(execPath, deviceType, backend))
+{
+}
+
+FastContext::~FastContext()
+{
+    releaseContext(*mContext);
+    delete mContext;
+}
+
+int FastContext::detect(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+                        const unsigned char* imgPtr, const int imgWidth, const int imgHeight,
+                        const int maxFeatures, int* threshold)
+{
+    return ::detect(*mContext, v_x, v_y, v_score, imgPtr, false, imgWidth, imgHeight, maxFeatures,
+                    mContext->mExecPath, mContext->mBackend, threshold);
+}
+
+int FastContext::detectRgb(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+                           const unsigned int* imgPtr, const int imgWidth, const int imgHeight,
+                           const int maxFeatures, int* threshold)
+{
+    return ::detect(*mContext, v_x, v_y, v_score, imgPtr, true, imgWidth, imgHeight, maxFeatures,
+                    mContext->mExecPath, mContext->mBackend, threshold);
+}
+
+void* FastContext::mapImage(const int imgWidth, const int imgHeight, bool rgb)
+{
+    std::lock_guard<std::mutex> lock(mContext->mMutex);
+    return ::mapImage(*mContext, imgWidth, imgHeight, rgb);
+}
+
+int FastContext::submit(unsigned long& ticket, const unsigned char* imgPtr, const int imgWidth,
+                        const int imgHeight, const int maxFeatures)
+{
+    std::lock_guard<std::mutex> lock(mContext->mMutex);
+    return ::submit(*mContext, ticket, imgPtr, imgWidth, imgHeight, maxFeatures, mContext->mExecPath,
+                    mContext->mBackend);
+}
+
+int FastContext::poll(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+                      unsigned long& ticket, bool wait, int* threshold)
+{
+    std::lock_guard<std::mutex> lock(mContext->mMutex);
+    return ::poll(*mContext, v_x, v_y, v_score, ticket, wait, threshold);
+}
+
+fastStreamStats FastContext::streamStatistics()
+{
+    return ::streamStatistics(*mContext);
+}
+
+void FastContext::setGrid(const fastGrid& grid)
+{
+    ::setGrid(*mContext, grid);
+}
+
+void FastContext::setThresholdControl(const fastThresholdControl& control)
+{
+    ::setThresholdControl(*mContext, control);
+}
+
+void FastContext::setPinnedBuffers(bool pinned)
+{
+    std::lock_guard<std::mutex> lock(mContext->mMutex);
+    mContext->mPinned = pinned;
+}
+
+fastPoolStats FastContext::bufferPoolStats()
+{
+    std::lock_guard<std::mutex> lock(mContext->mMutex);
+    fastPoolStats stats = { mContext->mBuffers.mHits, mContext->mBuffers.mMisses, mContext->mBuffers.mCapacity };
+    return stats;
+}
+
+void FastContext::setProfiling(bool enable)
+{
+    ::setProfiling(*mContext, enable);
+}
+
+fastProfile FastContext::profileStatistics()
+{
+    return ::profileStatistics(*mContext);
+}
+
+int fast(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+         const int* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
+         const std::string execPath, FastBackend backend, int* threshold)
+{
+    size_t imgEl = imgWidth*imgHeight;
+    std::vector<unsigned char> img(imgEl);
+    for (size_t i = 0; i < imgEl; i++)
+        img[i] = (unsigned char)std::min(std::max(imgPtr[i], 0), 255);
+
+    return fast(v_x, v_y, v_score, &img[0], imgWidth, imgHeight, maxFeatures, execPath, backend, threshold);
+}
@@ -16,6 +16,7 @@
 #include <algorithm>
 #include <chrono>
 #include "oclHelper.h"
+#include "fastCpu.h"
 
 //const int FAST_THREADS_X = 16;
 //const int FAST_THREADS_Y = 16;
@@ -24,6 +25,28 @@ const int FAST_THREADS_Y = 1;
 const int FAST_THREADS_NONMAX_X = 32;
 const int FAST_THREADS_NONMAX_Y = 8;
 
+// Widest stripe of columns, halo included, fast_pipeline_nonmax.xclbin
+// processes at once, has to match the WIDTH the binary was built with.
+// Wider frames are processed as several stripes.
+const int FAST_KERNEL_WIDTH = 640;
+
+// Widest stripe kernels built from source are specialized for. Narrower
+// stripes are used on devices whose local memory cannot hold the buffers
+// of that many columns.
+const int FAST_SOURCE_WIDTH = 1024;
+
+// Columns the kernel reads on each side of a stripe, the circle radius plus
+// one for the non-maximal suppression
+const int FAST_STRIPE_HALO = 4;
+
+// BT.709 luma weights in 1.15 fixed point used to convert color frames to
+// gray, on the host and in locate_features_rgb. They add up to
+// 1 << FAST_GRAY_SHIFT so white stays 255.
+const int FAST_GRAY_SHIFT = 15;
+const int FAST_GRAY_R = 6966;
+const int FAST_GRAY_G = 23436;
+const int FAST_GRAY_B = 2366;
+
 class Timer {
     time_t mTimeStart;
     time_t mTimeEnd;
@@ -44,13 +67,218 @@ public:
 
 typedef std::pair<int, int> Position;
 
-static int runOpenCL(std::vector<int>& x, std::vector<int>& y, std::vector<int>& score, double& delay,
-                     const int* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
-                     std::string kernelFile, cl_device_type deviceType, int iteration,
-                     int fast_thr, bool verbose);
+enum FastBackend
+{
+    FAST_BACKEND_AUTO,      // OpenCL accelerator when available, host otherwise
+    FAST_BACKEND_OPENCL,    // OpenCL accelerator only
+    FAST_BACKEND_CPU        // Multithreaded host implementation
+};
+
+// Reuse of the device buffers kept between calls to fast()
+struct fastPoolStats {
+    unsigned long mHits;        // Calls served by the existing buffers
+    unsigned long mMisses;      // Calls that had to (re)allocate them
+    size_t mCapacity;           // Largest frame, in bytes, they can hold
+};
+
+fastPoolStats fastBufferPoolStats();
+
+// Allocates the buffers of blocking frames with CL_MEM_ALLOC_HOST_PTR. The
+// image and the features then live in page locked host memory, transferred
+// by DMA on PCIe cards and used without any copy on CPU devices. Applies
+// when the buffers are next allocated. Off by default.
+void fastSetPinnedBuffers(bool pinned);
+
+// Maps the image buffer of the next blocking frame, so the caller can
+// write the frame straight into memory the device reads: width * height
+// bytes, or packed 32-bit pixels for fastRgb() with rgb set. Passing the
+// pointer to fast() or fastRgb() with the same size then skips the upload
+// copy. The pointer is valid until that call, or the next fastMapImage().
+// Returns null when there is no OpenCL device, the frame then has to be
+// kept elsewhere.
+void* fastMapImage(const int imgWidth, const int imgHeight, bool rgb = false);
+
+// Device time of blocking frames by stage, summed over the frames detected
+// since profiling was last switched
+struct fastProfile {
+    unsigned long mFrames;
+    oclEventTimes mUpload;      // Image write or unmap, and the count reset
+    oclEventTimes mKernel;      // Every stripe of the frame
+    oclEventTimes mRead;        // Count and feature list read or map
+};
+
+// Creates the queue of blocking frames with CL_QUEUE_PROFILING_ENABLE and
+// times every command through its event, which tells whether a deployment
+// is bound by PCIe transfers or by the kernel. Each frame then waits for
+// its last command. Off by default, switching it clears the statistics.
+void fastSetProfiling(bool enable);
+
+fastProfile fastProfileStatistics();
+
+// Grid retention: the image is split into mCols x mRows cells and only the
+// mPerCell strongest features of each cell are kept, before maxFeatures is
+// applied to the survivors. Spreads the features over the frame instead of
+// letting the highest contrast region take all of them. Off when any of the
+// fields is 0, which is the default.
+struct fastGrid {
+    int mCols;
+    int mRows;
+    int mPerCell;
+};
+
+// Applies to the calls to fast(), fastSubmit() and fastDispatchSubmit()
+// made afterwards
+void fastSetGrid(const fastGrid& grid);
+
+// Feedback control of the detection threshold. After every frame the
+// threshold is raised when more than mTarget candidates, give or take
+// mTolerance percent, were detected and lowered when fewer were, staying
+// within [mMin, mMax]. fast() and the streaming mode adjust their own
+// threshold. Off when mTarget is 0, which is the default: every frame is
+// then detected with a threshold of 20.
+struct fastThresholdControl {
+    int mTarget;
+    int mMin;
+    int mMax;
+    int mTolerance;
+};
+
+// Also restarts both thresholds from the default
+void fastSetThresholdControl(const fastThresholdControl& control);
+
+// The threshold the frame was detected with is stored in threshold when
+// it is not null
+int fast(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+         const unsigned char* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
+         const std::string execPath, FastBackend backend = FAST_BACKEND_AUTO, int* threshold = 0);
 
+// 32-bit pixels, clamped to 8 bits before detection
 int fast(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
          const int* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
-         const std::string execPath);
+         const std::string execPath, FastBackend backend = FAST_BACKEND_AUTO, int* threshold = 0);
+
+// Packed 32-bit 0xAARRGGBB pixels, as QImage::Format_RGB32 stores them.
+// The frame is uploaded as it is and converted to gray by the kernel while
+// it is read, with the FAST_GRAY_* weights. Converted on the host when the
+// binary has no locate_features_rgb kernel or when falling back to the host.
+int fastRgb(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+            const unsigned int* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
+            const std::string execPath, FastBackend backend = FAST_BACKEND_AUTO, int* threshold = 0);
+
+// Frames that can be in flight at once in streaming mode
+const int FAST_STREAM_DEPTH = 3;
+
+// Device time accumulated by the streaming mode, in milliseconds
+struct fastStreamStats {
+    unsigned long mFrames;      // Frames returned by fastPoll()
+    double mUploadMs;
+    double mKernelMs;
+    double mReadMs;
+    double mSpanMs;             // From the first upload to the last readback
+    double mOverlap;            // (upload + kernel + read) / span, 1 when nothing overlapped
+};
+
+// Queues a frame without waiting for its features. Returns 0 and the frame's
+// ticket on success, 1 when FAST_STREAM_DEPTH frames are already in flight
+// and fastPoll() has to be called first, -1 on errors. Frames that fall back
+// to the host are detected before returning.
+int fastSubmit(unsigned long& ticket, const unsigned char* imgPtr, const int imgWidth, const int imgHeight,
+               const int maxFeatures, const std::string execPath, FastBackend backend = FAST_BACKEND_AUTO);
+
+// Returns the features of the oldest frame in flight, in submission order.
+// Returns 0 and the frame's ticket when they are available, 1 when no frame
+// is in flight or, with wait == false, the oldest one has not finished yet.
+// The threshold the frame was detected with is stored in threshold when it
+// is not null.
+int fastPoll(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+             unsigned long& ticket, bool wait = true, int* threshold = 0);
+
+fastStreamStats fastStreamStatistics();
+
+// Frames detected by each queue of the dispatcher
+struct fastDispatchStats {
+    int mDevices;
+    std::vector<int> mDevice;               // Device of each queue
+    std::vector<unsigned long> mFrames;     // Frames each queue detected
+};
+
+// Opens every OpenCL device of deviceType, each with queuesPerDevice queues
+// served by host threads. With queuesPerDevice 0 every device gets one queue
+// per compute unit it reports (CL_DEVICE_MAX_COMPUTE_UNITS, at most 16), or a
+// single queue when it reports none. Frames given to fastDispatchSubmit()
+// wait in one shared queue and are detected by the first idle queue; a queue
+// never takes frames from another. Returns the number of queues, 0 when no
+// device could load the kernel. Restarts the dispatcher when it was running.
+int fastDispatchStart(const std::string execPath, cl_device_type deviceType = CL_DEVICE_TYPE_ACCELERATOR,
+                      unsigned queuesPerDevice = 0);
+
+// Queues a frame, copied before returning. Returns 0 and the frame's ticket
+// on success, 1 when two frames per queue are waiting or in flight and
+// fastDispatchPoll() has to be called first, -1 when the dispatcher is not
+// running. Frames a device fails on are detected on the host.
+int fastDispatchSubmit(unsigned long& ticket, const unsigned char* imgPtr, const int imgWidth,
+                       const int imgHeight, const int maxFeatures);
+
+// Same contract as fastPoll(): the oldest frame first, 1 when there is none
+// or, with wait == false, it has not finished yet
+int fastDispatchPoll(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+                     unsigned long& ticket, bool wait = true, int* threshold = 0);
+
+// Drops the frames not polled yet and releases the devices
+void fastDispatchStop();
+
+fastDispatchStats fastDispatchStatistics();
+
+struct oclContext;
+
+// Device, programs, buffers, grid and threshold state of blocking detection
+// and of the streaming mode. fast(), fastRgb(), fastSubmit() and fastPoll()
+// share one process wide context; a FastContext owns its own, so threads
+// with a context each do not wait on one another for the device. Frames
+// detected on the host still share the global ThreadPool and run one after
+// the other. The dispatcher opens every device of a type and stays process
+// wide. One context may be shared between threads, and its calls are then
+// serialized, including a poll() waiting for its frame. The device is
+// opened by the first frame. A deviceType other than
+// CL_DEVICE_TYPE_ACCELERATOR builds the kernel from source.
+class FastContext {
+    oclContext* mContext;
+
+    FastContext(const FastContext&);
+    FastContext& operator=(const FastContext&);
+
+public:
+    explicit FastContext(const std::string execPath, cl_device_type deviceType = CL_DEVICE_TYPE_ACCELERATOR,
+                         FastBackend backend = FAST_BACKEND_AUTO);
+    ~FastContext();
+
+    // Same as fast() and fastRgb()
+    int detect(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+               const unsigned char* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
+               int* threshold = 0);
+    int detectRgb(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+                  const unsigned int* imgPtr, const int imgWidth, const int imgHeight, const int maxFeatures,
+                  int* threshold = 0);
+
+    // Same as fastMapImage(), the pointer is only valid for this context
+    void* mapImage(const int imgWidth, const int imgHeight, bool rgb = false);
+
+    // Same as fastSubmit(), fastPoll() and fastStreamStatistics(), with
+    // FAST_STREAM_DEPTH frames in flight per context
+    int submit(unsigned long& ticket, const unsigned char* imgPtr, const int imgWidth, const int imgHeight,
+               const int maxFeatures);
+    int poll(std::vector<int>& v_x, std::vector<int>& v_y, std::vector<int>& v_score,
+             unsigned long& ticket, bool wait = true, int* threshold = 0);
+    fastStreamStats streamStatistics();
+
+    void setGrid(const fastGrid& grid);
+    void setThresholdControl(const fastThresholdControl& control);
+    void setPinnedBuffers(bool pinned);
+    fastPoolStats bufferPoolStats();
+
+    // Same as fastSetProfiling() and fastProfileStatistics()
+    void setProfiling(bool enable);
+    fastProfile profileStatistics();
+};
 
 #endif
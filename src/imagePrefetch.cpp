@@ -0,0 +1,211 @@
+/*******************************************************
+ * Copyright (c) 2015, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#include "imagePrefetch.h"
+#include <QDateTime>
+#include <QFileInfo>
+#include <algorithm>
+#include <utility>
+
+FrameCache::FrameCache()
+    : mCapacity(256 << 20), mSize(0)
+{
+}
+
+// Called with mMutex held
+void FrameCache::evict(size_t capacity)
+{
+    while (mSize > capacity && !mUses.empty()) {
+        auto it = mEntries.find(mUses.back());
+        mSize -= it->second.mBytes;
+        mEntries.erase(it);
+        mUses.pop_back();
+    }
+}
+
+bool FrameCache::lookup(const std::string& key, PrefetchedImage& frame)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mEntries.find(key);
+    if (it == mEntries.end())
+        return false;
+
+    Entry& entry = it->second;
+    mUses.splice(mUses.begin(), mUses, entry.mUse);
+
+    frame.mImage = entry.mImage;
+    frame.mWidth = entry.mWidth;
+    frame.mHeight = entry.mHeight;
+    frame.mGray.assign(entry.mGray.begin(), entry.mGray.end());
+    return true;
+}
+
+void FrameCache::insert(const std::string& key, const PrefetchedImage& frame)
+{
+    size_t bytes = frame.mGray.size() + frame.mImage.byteCount();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (frame.mGray.empty() || bytes > mCapacity || mEntries.count(key))
+        return;
+
+    evict(mCapacity - bytes);
+    mUses.push_front(key);
+
+    Entry& entry = mEntries[key];
+    entry.mImage = frame.mImage;
+    entry.mGray = frame.mGray;
+    entry.mWidth = frame.mWidth;
+    entry.mHeight = frame.mHeight;
+    entry.mBytes = bytes;
+    entry.mUse = mUses.begin();
+    mSize += bytes;
+}
+
+void FrameCache::setCapacity(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCapacity = bytes;
+    evict(mCapacity);
+}
+
+ImagePrefetcher::ImagePrefetcher()
+    : mConvert(0), mDepth(0), mLoop(false), mStop(false), mClaimed(0), mConsumed(0)
+{
+}
+
+ImagePrefetcher::~ImagePrefetcher()
+{
+    stop();
+}
+
+// Called with mMutex held
+bool ImagePrefetcher::canClaim() const
+{
+    if (mClaimed - mConsumed >= mDepth)
+        return false;
+    return mLoop || mClaimed < (unsigned long)mFiles.size();
+}
+
+// Called with mMutex held
+bool ImagePrefetcher::exhausted() const
+{
+    return !mLoop && mClaimed >= (unsigned long)mFiles.size() && mConsumed >= mClaimed;
+}
+
+void ImagePrefetcher::decodeFiles()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (;;) {
+        mSpace.wait(lock, [this] { return mStop || canClaim(); });
+        if (mStop)
+            return;
+
+        PrefetchedImage frame;
+        frame.mSequence = mClaimed++;
+        QString fileName = mDirectory + '/' + mFiles[frame.mSequence % mFiles.size()];
+
+        bool cache = mLoop;
+        if (!mSpare.empty()) {
+            frame.mGray.swap(mSpare.back());
+            mSpare.pop_back();
+        }
+
+        // Decoding and conversion run unlocked, frames may complete out of
+        // order and are put back in order by next()
+        lock.unlock();
+        QFileInfo info(fileName);
+        std::string key = fileName.toStdString() + '@' +
+                          QString::number(info.lastModified().toMSecsSinceEpoch()).toStdString();
+        if (!mCache.lookup(key, frame)) {
+            frame.mImage = QImage(fileName.toUtf8().constData());
+            frame.mWidth = 0;
+            frame.mHeight = 0;
+            mConvert(frame.mGray, frame.mWidth, frame.mHeight, frame.mImage);
+            if (cache)
+                mCache.insert(key, frame);
+        }
+        lock.lock();
+
+        mReady[frame.mSequence] = std::move(frame);
+        mDecoded.notify_all();
+    }
+}
+
+void ImagePrefetcher::start(const QString& directory, const QStringList& files, GrayConversion convert,
+                            unsigned depth, unsigned threads, bool loop)
+{
+    stop();
+
+    mDirectory = directory;
+    mFiles = files;
+    mConvert = convert;
+    mDepth = std::max(depth, 1u);
+    mLoop = loop;
+    mStop = false;
+    mClaimed = 0;
+    mConsumed = 0;
+
+    if (mFiles.isEmpty())
+        return;
+
+    // More decoders than frames in flight would only wait
+    threads = std::min(std::max(threads, 1u), mDepth);
+    for (unsigned i = 0; i < threads; i++)
+        mThreads.push_back(std::thread(&ImagePrefetcher::decodeFiles, this));
+}
+
+bool ImagePrefetcher::next(PrefetchedImage& frame)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mThreads.empty())
+        return false;
+
+    mDecoded.wait(lock, [this] { return mStop || mReady.count(mConsumed) || exhausted(); });
+    auto it = mReady.find(mConsumed);
+    if (it == mReady.end())
+        return false;
+
+    std::swap(frame, it->second);
+    if (it->second.mGray.capacity() > 0 && mSpare.size() < mDepth) {
+        mSpare.push_back(std::vector<uchar>());
+        mSpare.back().swap(it->second.mGray);
+    }
+    mReady.erase(it);
+    mConsumed++;
+    mSpace.notify_all();
+    return true;
+}
+
+void ImagePrefetcher::setLoop(bool loop)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mLoop = loop;
+    mSpace.notify_all();
+    mDecoded.notify_all();
+}
+
+void ImagePrefetcher::setCacheCapacity(size_t bytes)
+{
+    mCache.setCapacity(bytes);
+}
+
+void ImagePrefetcher::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+        mSpace.notify_all();
+        mDecoded.notify_all();
+    }
+    for (size_t i = 0; i < mThreads.size(); i++)
+        mThreads[i].join();
+    mThreads.clear();
+
+    mReady.clear();
+}
@@ -0,0 +1,115 @@
+/*******************************************************
+ * Copyright (c) 2015, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#ifndef _IMAGE_PREFETCH_H_
+#define _IMAGE_PREFETCH_H_
+
+#include <QImage>
+#include <QString>
+#include <QStringList>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Converts a decoded image to the pixels detection reads, 8-bit gray or
+// packed color, resizing out as needed
+typedef void (*GrayConversion)(std::vector<uchar>& out, int& width, int& height, const QImage& image);
+
+// A decoded frame, ready for detection
+struct PrefetchedImage {
+    unsigned long mSequence;    // Position in the order the files are shown
+    QImage mImage;
+    std::vector<uchar> mGray;
+    int mWidth;
+    int mHeight;
+};
+
+// Decoded frames kept across passes over the same files. Keyed by path and
+// modification time, so edited files are decoded again. The least recently
+// used frames are dropped once more than the capacity, in bytes, is held.
+class FrameCache {
+    struct Entry {
+        QImage mImage;
+        std::vector<uchar> mGray;
+        int mWidth;
+        int mHeight;
+        size_t mBytes;
+        std::list<std::string>::iterator mUse;
+    };
+
+    std::map<std::string, Entry> mEntries;
+    std::list<std::string> mUses;   // Most recently used first
+    size_t mCapacity;
+    size_t mSize;
+    std::mutex mMutex;
+
+    void evict(size_t capacity);
+
+public:
+    FrameCache();
+
+    // Copies the cached gray buffer into frame when key is cached
+    bool lookup(const std::string& key, PrefetchedImage& frame);
+    void insert(const std::string& key, const PrefetchedImage& frame);
+
+    void setCapacity(size_t bytes);
+};
+
+// Decodes and converts upcoming files on a few threads ahead of the
+// consumer. At most depth frames are decoded or waiting to be consumed at
+// any time, decoders block until the consumer takes the oldest one.
+class ImagePrefetcher {
+    QString mDirectory;
+    QStringList mFiles;
+    GrayConversion mConvert;
+    unsigned mDepth;
+    std::atomic<bool> mLoop;    // Start over after the last file
+    bool mStop;
+    unsigned long mClaimed;     // Next frame handed to a decoder
+    unsigned long mConsumed;    // Next frame returned by next()
+    std::map<unsigned long, PrefetchedImage> mReady;
+    std::mutex mMutex;
+    std::condition_variable mSpace;
+    std::condition_variable mDecoded;
+    std::vector<std::thread> mThreads;
+    FrameCache mCache;          // Filled while looping, kept between runs
+    std::vector<std::vector<uchar> > mSpare;    // Gray buffers to reuse
+
+    bool canClaim() const;
+    bool exhausted() const;
+    void decodeFiles();
+
+public:
+    ImagePrefetcher();
+    ~ImagePrefetcher();
+
+    void start(const QString& directory, const QStringList& files, GrayConversion convert,
+               unsigned depth, unsigned threads, bool loop);
+
+    // Returns the next frame in file order, waiting for it to be decoded.
+    // Returns false once every file was returned and looping is off, or
+    // after stop(). The gray buffer frame held before is handed to the
+    // decoders, so passing the same frame every time avoids allocations.
+    bool next(PrefetchedImage& frame);
+
+    void setLoop(bool loop);
+
+    // Memory the decoded frame cache may use, 0 disables it
+    void setCacheCapacity(size_t bytes);
+
+    // Waits for the decoders and drops the frames not consumed yet
+    void stop();
+};
+
+#endif
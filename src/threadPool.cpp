@@ -0,0 +1,116 @@
+/*******************************************************
+ * Copyright (c) 2015, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#include "threadPool.h"
+
+ThreadPool::ThreadPool(unsigned nthreads)
+    : mJob(0), mJobTasks(0), mJobThreads(0), mGeneration(0), mFinished(0), mNextTask(0), mStop(false)
+{
+    if (nthreads == 0)
+        nthreads = std::thread::hardware_concurrency();
+    if (nthreads == 0)
+        nthreads = 1;
+
+    for (unsigned i = 1; i < nthreads; i++)
+        mWorkers.push_back(std::thread(&ThreadPool::worker, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWake.notify_all();
+    for (size_t i = 0; i < mWorkers.size(); i++)
+        mWorkers[i].join();
+}
+
+// Executes tasks of the current job until none are left
+void ThreadPool::drain(const std::function<void(unsigned)>& fn, unsigned ntasks)
+{
+    for (;;) {
+        unsigned task = mNextTask++;
+        if (task >= ntasks)
+            break;
+        fn(task);
+    }
+}
+
+void ThreadPool::worker(unsigned id)
+{
+    unsigned long seen = 0;
+    for (;;) {
+        const std::function<void(unsigned)>* job = 0;
+        unsigned ntasks = 0;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWake.wait(lock, [&] { return mStop || mGeneration != seen; });
+            if (mStop)
+                return;
+            seen = mGeneration;
+            if (id >= mJobThreads)
+                continue;
+            job = mJob;
+            ntasks = mJobTasks;
+        }
+
+        drain(*job, ntasks);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mFinished++;
+        }
+        mDone.notify_one();
+    }
+}
+
+void ThreadPool::run(unsigned ntasks, const std::function<void(unsigned)>& fn, unsigned maxThreads)
+{
+    if (ntasks == 0)
+        return;
+
+    unsigned nthreads = size();
+    if (maxThreads != 0 && maxThreads < nthreads)
+        nthreads = maxThreads;
+    if (ntasks < nthreads)
+        nthreads = ntasks;
+
+    if (nthreads <= 1) {
+        for (unsigned i = 0; i < ntasks; i++)
+            fn(i);
+        return;
+    }
+
+    std::lock_guard<std::mutex> runLock(mRunMutex);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mJob = &fn;
+        mJobTasks = ntasks;
+        mJobThreads = nthreads;
+        mFinished = 0;
+        mNextTask = 0;
+        mGeneration++;
+    }
+    mWake.notify_all();
+
+    drain(fn, ntasks);
+
+    // Every participating worker has to check in before returning, otherwise
+    // a late one could pick up the next job's counter with this job's task
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDone.wait(lock, [&] { return mFinished == mJobThreads - 1; });
+    mJob = 0;
+}
+
+ThreadPool& ThreadPool::global()
+{
+    static ThreadPool pool;
+    return pool;
+}